@@ -4,6 +4,22 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
+#ifdef EPOLL
+#include <sys/eventfd.h>
+#endif // EPOLL
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+
+// older glibc does not define it
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif // __linux__
+
 // currentry, this code can run on X86_64 System V ABI
 
 namespace lunar {
@@ -11,52 +27,108 @@ namespace lunar {
 __thread green_thread *lunar_gt = nullptr;
 __thread uint64_t thread_id;
 
+// re-read lunar_gt after switching contexts.
+// a context may be resumed by another scheduler, but compilers may reuse
+// the address of a TLS variable computed before the switch in the same
+// function, so that the address is computed by this non-inlined function
+// which is not regarded as pure by the barrier
+static green_thread* __attribute__((noinline))
+get_lunar_gt()
+{
+    asm volatile ("" : : : "memory");
+    return lunar_gt;
+}
+
 rtm_lock lock_thread2gt;
 std::unordered_map<uint64_t, green_thread*> thread2gt;
 
+volatile int gls_num_keys = 0;
+void (*gls_destructor[GT_GLS_KEYS])(void*);
+
 // stack layout:
-//    [empty]
+//    x87 CW, MXCSR
 //    context
 //    argument
 //    func     <- %rsp
 asm (
     ".global ___INVOKE;"
     "___INVOKE:"
+    "ldmxcsr 24(%rsp);"   // the floating-point environment at spawn
+    "fldcw 28(%rsp);"
     "movq 8(%rsp), %rdi;" // set the argument
     "callq *(%rsp);"      // call func()
-    "movq 16(%rsp), %rax;"
-    "movl $128, (%rax);"    // context.m_state = STOP
+    "movq 16(%rsp), %rdi;" // set the context
 #ifdef __APPLE__
-    "call _schedule_green_thread;"  // call _schedule_green_thread
+    "call _finish_green_thread;"  // call _finish_green_thread
 #else  // *BSD, Linux
-    "call schedule_green_thread;"   // call schedule_green_thread
+    "call finish_green_thread;"   // call finish_green_thread
 #endif // __APPLE__
 );
 
-void update_clock();
-
-class local_clock {
-public:
-    local_clock() : m_th(update_clock) { m_th.detach(); }
-    std::thread m_th;
-};
+// void lunar_swap_context(uint64_t **save_sp, uint64_t *sp);
+//
+// save the callee-saved registers of System V ABI on the current stack,
+// store the stack pointer to *save_sp, and restore the registers from sp.
+// the x87 control word and MXCSR are not switched, because loading them
+// costs more than the rest of the switch. green threads on a scheduler
+// share them, and a green thread starts with those of its spawner
+//
+// saved frame:
+//    return address
+//    %rbp
+//    %rbx
+//    %r12
+//    %r13
+//    %r14
+//    %r15          <- sp
+asm (
+#ifdef __APPLE__
+    ".global _lunar_swap_context;"
+    "_lunar_swap_context:"
+#else  // *BSD, Linux
+    ".global lunar_swap_context;"
+    "lunar_swap_context:"
+#endif // __APPLE__
+    "pushq %rbp;"
+    "pushq %rbx;"
+    "pushq %r12;"
+    "pushq %r13;"
+    "pushq %r14;"
+    "pushq %r15;"
+    "movq %rsp, (%rdi);" // *save_sp = %rsp
+    "movq %rsi, %rsp;"   // %rsp = sp
+    "popq %r15;"
+    "popq %r14;"
+    "popq %r13;"
+    "popq %r12;"
+    "popq %rbx;"
+    "popq %rbp;"
+    "ret;"
+);
 
-static volatile uint64_t lunar_clock; // milliseconds
-static local_clock thread_clock;
+extern "C" void ___INVOKE();
 
-void
-update_clock()
+static inline uint64_t
+get_monotonic_ns()
 {
-    timespec t0;
-    GETTIME(&t0);
+    timespec t;
+    GETTIME(&t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
 
-    for (;;) {
-        timespec t1;
-        GETTIME(&t1);
-        TIMESPECSUB(&t1, &t0);
-        lunar_clock = t1.tv_sec * 1000 + t1.tv_nsec * 1e-6;
-        usleep(1000);
-    }
+static const uint64_t lunar_clock_base = get_monotonic_ns();
+
+#ifdef LUNAR_TRACE
+#define TRACE_GT(TYPE, ID, ARG) m_trace->record(rdtsc(), TYPE, ID, ARG)
+#else
+#define TRACE_GT(TYPE, ID, ARG)
+#endif // LUNAR_TRACE
+
+// microseconds for timeouts
+static inline uint64_t
+get_clock_us()
+{
+    return (get_monotonic_ns() - lunar_clock_base) / 1000;
 }
 
 extern "C" {
@@ -67,6 +139,12 @@ get_streams_ready_green_thread(void ***streams, ssize_t *len)
     return lunar_gt->get_streams_ready(streams, len);
 }
 
+void
+get_joins_ready_green_thread(void ***handles, ssize_t *len)
+{
+    return lunar_gt->get_joins_ready(handles, len);
+}
+
 bool
 is_timeout_green_thread()
 {
@@ -79,10 +157,120 @@ is_ready_threadq_green_thread()
     return lunar_gt->is_ready_threadq();
 }
 
+bool
+is_cancelled_green_thread()
+{
+    return lunar_gt->is_cancelled();
+}
+
+int
+gls_create_key_green_thread(void (*destructor)(void*))
+{
+    int key = __sync_fetch_and_add(&gls_num_keys, 1);
+    if (key >= GT_GLS_KEYS) {
+        __sync_fetch_and_sub(&gls_num_keys, 1);
+        return -1;
+    }
+
+    gls_destructor[key] = destructor;
+
+    return key;
+}
+
+void*
+gls_get_green_thread(int key)
+{
+    assert(key >= 0 && key < GT_GLS_KEYS);
+    return lunar_gt->get_gls(key);
+}
+
+void
+gls_set_green_thread(int key, void *value)
+{
+    assert(key >= 0 && key < GT_GLS_KEYS);
+    lunar_gt->set_gls(key, value);
+}
+
+bool
+cancel_green_thread(int64_t id)
+{
+    return lunar_gt->cancel(id);
+}
+
+bool
+enable_accounting_green_thread()
+{
+    if (lunar_gt == nullptr)
+        return false;
+
+    lunar_gt->enable_accounting();
+
+    return true;
+}
+
+bool
+enable_preemption_green_thread(uint64_t slice_us)
+{
+    if (lunar_gt == nullptr)
+        return false;
+
+    return lunar_gt->enable_preemption(slice_us);
+}
+
+void
+preempt_point_green_thread()
+{
+    lunar_gt->preempt_point();
+}
+
+void
+set_max_events_green_thread(int max_events)
+{
+    lunar_gt->set_max_events(max_events);
+}
+
+void
+set_idle_policy_green_thread(uint64_t spin_us, uint64_t yield_us)
+{
+    lunar_gt->set_idle_policy(spin_us, yield_us);
+}
+
+bool
+get_stats_green_thread(uint64_t thid, stats_green_thread *stats)
+{
+    rtm_transaction tr(lock_thread2gt);
+    auto it = thread2gt.find(thid);
+    if (it == thread2gt.end())
+        return false;
+
+    it->second->get_stats(stats);
+
+    return true;
+}
+
+// return the number of contexts stored in stats,
+// or -1 if the scheduler is not found or accounting is disabled
+ssize_t
+get_context_stats_green_thread(uint64_t thid, context_stats_green_thread *stats, size_t len)
+{
+    rtm_transaction tr(lock_thread2gt);
+    auto it = thread2gt.find(thid);
+    if (it == thread2gt.end())
+        return -1;
+
+    return it->second->get_context_stats(stats, len);
+}
+
 uint64_t
 get_clock()
 {
-    return lunar_clock;
+    return (get_monotonic_ns() - lunar_clock_base) / 1000000;
+}
+
+uint64_t
+get_clock_ns()
+{
+    return get_monotonic_ns() - lunar_clock_base;
 }
 
 uint64_t
@@ -104,6 +292,15 @@ get_green_thread(uint64_t thid)
     }
 }
 
+int
+close_fd_green_thread(int fd)
+{
+    if (lunar_gt == nullptr)
+        return close(fd);
+
+    return lunar_gt->close_fd(fd);
+}
+
 void*
 get_threadq_green_thread(uint64_t thid)
 {
@@ -122,6 +319,7 @@ init_green_thread(uint64_t thid, int qlen, int vecsize)
 {
     bool result;
     if (lunar_gt == nullptr) {
+        thread_id = thid;
         lunar_gt = new green_thread(qlen, vecsize);
         rtm_transaction tr(lock_thread2gt);
         if (thread2gt.find(thid) != thread2gt.end()) {
@@ -142,185 +340,578 @@ init_green_thread(uint64_t thid, int qlen, int vecsize)
     return true;
 }
 
-void
-schedule_green_thread()
+#ifdef __linux__
+// the NUMA node of cpu is found as /sys/devices/system/cpu/cpuN/nodeM
+static int
+numa_node_of_cpu(int cpu)
 {
-    lunar_gt->schedule();
-}
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
+        return 0;
+
+    int node = 0;
+    for (struct dirent *ent = readdir(dir); ent != nullptr; ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "node", 4) == 0 &&
+            ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
 
-void
-spawn_green_thread(void (*func)(void*), void *arg)
-{
-    lunar_gt->spawn(func, arg, lunar_gt->m_pagesize * 1024);
+    closedir(dir);
+
+    return node;
 }
+#endif // __linux__
 
-void
-run_green_thread()
+bool
+init_green_thread_on_cpu(uint64_t thid, int qlen, int vecsize, int cpu)
 {
-    lunar_gt->run();
+#ifdef __linux__
+    if (lunar_gt != nullptr || cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
 
-    {
-        rtm_transaction tr(lock_thread2gt);
-        thread2gt.erase(get_thread_id());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        PRINTERR("failed sched_setaffinity!: %s", strerror(errno));
+        return false;
     }
 
-    delete lunar_gt;
-}
+    if (! init_green_thread(thid, qlen, vecsize))
+        return false;
 
-#ifdef KQUEUE
-void
-select_green_thread(struct kevent *kev, int num_kev,
-                    void * const *stream, int num_stream,
-                    bool is_threadq, int64_t timeout)
-{
-    lunar_gt->select_stream(kev, num_kev, stream, num_stream, is_threadq, timeout);
-}
-#elif (defined EPOLL)
-void
-select_green_thread(epoll_event *eev, int num_eev,
-                    void * const *stream, int num_stream,
-                    bool is_threadq, int64_t timeout)
-{
-    lunar_gt->select_stream(eev, num_eev, stream, num_stream, is_threadq, timeout);
-}
-#endif // KQUEUE
+    lunar_gt->set_cpu(cpu, numa_node_of_cpu(cpu));
 
-STRM_RESULT
-push_threadq_green_thread(void *thq, char *p)
-{
-    return ((green_thread::threadq*)thq)->push(p);
+    return true;
+#else
+    return false;
+#endif // __linux__
 }
 
-STRM_RESULT
-pop_threadq_green_thread(char *p)
+bool
+init_green_thread_ex(uint64_t thid, int qlen, int vecsize, uint32_t flags)
 {
-    return lunar_gt->pop_threadq(p);
-}
+    if (! init_green_thread(thid, qlen, vecsize))
+        return false;
 
-STRM_RESULT
-pop_stream_ptr(void *p, void **data)
-{
-    return lunar_gt->pop_stream<void*>((shared_stream*)p, *data);
-}
+#ifdef LUNAR_URING
+    if (flags & GT_BACKEND_URING)
+        lunar_gt->enable_uring();
+#endif // LUNAR_URING
 
-STRM_RESULT
-pop_stream_bytes(void *p, char *data)
-{
-    return lunar_gt->pop_streamN<char>((shared_stream*)p, data);
+    return true;
 }
 
-STRM_RESULT
-push_stream_ptr(void *p, void *data)
+bool
+is_uring_green_thread()
 {
-    return lunar_gt->push_stream<void*>((shared_stream*)p, data);
+    return lunar_gt->is_uring();
 }
 
-STRM_RESULT
-push_stream_bytes(void *p, char *data)
+int
+get_cpu_green_thread(uint64_t thid)
 {
-    return lunar_gt->push_streamN<char>((shared_stream*)p, data);
-}
+    rtm_transaction tr(lock_thread2gt);
+    auto it = thread2gt.find(thid);
+    if (it == thread2gt.end())
+        return -1;
 
-void
-push_stream_eof(void *p)
-{
-    lunar_gt->push_eof_stream<void*>((shared_stream*)p);
+    return it->second->get_cpu();
 }
 
-void
-get_fds_ready_green_thread(fdevent_green_thread **events, ssize_t *len)
+int
+get_numa_node_green_thread(uint64_t thid)
 {
-    lunar_gt->get_fds_ready(events, len);
-}
+    rtm_transaction tr(lock_thread2gt);
+    auto it = thread2gt.find(thid);
+    if (it == thread2gt.end())
+        return -1;
 
-} // extern "C"
+    return it->second->get_numa_node();
+}
 
-template<typename T>
-STRM_RESULT
-green_thread::pop_stream(shared_stream *p, T &ret)
+ssize_t
+get_nearby_threads_green_thread(uint64_t thid, uint64_t *thids, size_t len)
 {
-    assert(p->flag & shared_stream::READ);
+    rtm_transaction tr(lock_thread2gt);
+    auto it = thread2gt.find(thid);
+    if (it == thread2gt.end() || it->second->get_numa_node() < 0)
+        return 0;
 
-    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+    int node = it->second->get_numa_node();
+    size_t n = 0;
 
-    auto result = q->pop(&ret);
+    for (auto &p: thread2gt) {
+        if (n == len)
+            break;
 
-    assert(result != STRM_NO_VACANCY);
+        if (p.first != thid && p.second->get_numa_node() == node)
+            thids[n++] = p.first;
+    }
 
-    return result;
+    return n;
 }
 
-template<typename T>
-STRM_RESULT
-green_thread::pop_streamN(shared_stream *p, T *ret)
+struct runtime {
+    std::mutex                 m_mutex;
+    std::condition_variable    m_cond;     // ready barrier
+    int                        m_num_ready;
+    uint64_t                   m_thid_base;
+    std::vector<std::thread>   m_threads;
+    std::vector<green_thread*> m_gts;      // nullptr if init failed
+};
+
+runtime *lunar_runtime = nullptr;
+
+static void
+runtime_thread(runtime *rt, int idx, lunar_runtime_options opts)
 {
-    assert(p->flag & shared_stream::READ);
+    uint64_t thid = rt->m_thid_base + idx;
+    bool result;
 
-    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+    if (opts.cpus)
+        result = init_green_thread_on_cpu(thid, opts.qlen, opts.vecsize, opts.cpus[idx]);
+    else
+        result = init_green_thread(thid, opts.qlen, opts.vecsize);
 
-    auto result = q->popN(ret);
+    if (result) {
+        if (opts.is_steal)
+            enable_steal_green_thread();
 
-    assert(result != STRM_NO_VACANCY);
+        lunar_gt->set_resident();
+    }
 
-    return result;
-}
+    {
+        std::lock_guard<std::mutex> lock(rt->m_mutex);
+        rt->m_gts[idx] = result ? lunar_gt : nullptr;
+        rt->m_num_ready++;
+    }
 
-#define NOTIFY_STREAM(STREAM, QUEUE)                                           \
-    do {                                                                       \
-        auto it = m_wait_stream.find(QUEUE);                                   \
-        if (it != m_wait_stream.end()) {                                       \
-            it->second->m_state |= context::SUSPENDING;                        \
-            it->second->m_ev_stream.push_back(STREAM->shared_data->readstrm);  \
-            m_suspend.push_back(it->second);                                   \
-            m_wait_stream.erase(it);                                           \
-        }                                                                      \
-    } while (0)
+    rt->m_cond.notify_all();
 
-template<typename T>
-STRM_RESULT
-green_thread::push_stream(shared_stream *p, T data)
+    if (result)
+        run_green_thread();
+}
+
+bool
+lunar_runtime_start(int nthreads, const lunar_runtime_options *options)
 {
-    assert(p->flag & shared_stream::WRITE);
+    if (lunar_runtime != nullptr || nthreads <= 0)
+        return false;
 
-    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+    lunar_runtime_options opts;
+    memset(&opts, 0, sizeof(opts));
+    if (options)
+        opts = *options;
 
-    if (p->shared_data->flag_shared & shared_stream::CLOSED_READ || q->is_eof()) {
-        NOTIFY_STREAM(p, q);
-        return STRM_CLOSED;
-    }
+    if (opts.qlen == 0)
+        opts.qlen = 1024;
 
-    auto result = q->push(&data);
-    if (result == STRM_SUCCESS) {
-        NOTIFY_STREAM(p, q);
-    }
+    if (opts.vecsize == 0)
+        opts.vecsize = sizeof(void*);
 
-    return result;
-}
+    auto rt = new runtime;
+    rt->m_num_ready = 0;
+    rt->m_thid_base = opts.thid_base;
+    rt->m_gts.resize(nthreads, nullptr);
 
-template<typename T>
-STRM_RESULT
-green_thread::push_streamN(shared_stream *p, T *data)
-{
-    assert(p->flag & shared_stream::WRITE);
+    for (int i = 0; i < nthreads; i++)
+        rt->m_threads.push_back(std::thread(runtime_thread, rt, i, opts));
 
-    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+    bool result = true;
+    {
+        std::unique_lock<std::mutex> lock(rt->m_mutex);
+        while (rt->m_num_ready < nthreads)
+            rt->m_cond.wait(lock);
 
-    if (p->shared_data->flag_shared & shared_stream::CLOSED_READ || q->is_eof()) {
-        NOTIFY_STREAM(p, q);
-        return STRM_CLOSED;
+        for (auto gt: rt->m_gts) {
+            if (gt == nullptr)
+                result = false;
+        }
     }
 
-    auto result = q->pushN(data);
-    if (result == STRM_SUCCESS) {
-        NOTIFY_STREAM(p, q);
+    lunar_runtime = rt;
+
+    if (! result) {
+        lunar_runtime_shutdown();
+        return false;
     }
 
-    return result;
+    return true;
 }
 
-template<typename T>
-void
-green_thread::push_eof_stream(shared_stream *p)
+bool
+spawn_on(uint64_t thid, void (*func)(void*), void *arg)
+{
+    if (lunar_gt && thread_id == thid) {
+        lunar_gt->spawn(func, arg, GT_STACK_4M);
+        return true;
+    }
+
+    auto rt = lunar_runtime;
+    if (rt == nullptr || thid < rt->m_thid_base || thid - rt->m_thid_base >= rt->m_gts.size())
+        return false;
+
+    rt->m_gts[thid - rt->m_thid_base]->post_spawn(func, arg);
+
+    return true;
+}
+
+void
+lunar_runtime_shutdown()
+{
+    auto rt = lunar_runtime;
+    if (rt == nullptr)
+        return;
+
+    for (auto gt: rt->m_gts) {
+        if (gt)
+            gt->post_shutdown();
+    }
+
+    for (auto &th: rt->m_threads)
+        th.join();
+
+    lunar_runtime = nullptr;
+    delete rt;
+}
+
+void
+schedule_green_thread()
+{
+    lunar_gt->schedule();
+}
+
+void
+finish_green_thread(void *ctx)
+{
+    lunar_gt->finish(ctx);
+}
+
+void
+spawn_green_thread(void (*func)(void*), void *arg)
+{
+    lunar_gt->spawn(func, arg, GT_STACK_4M);
+}
+
+// stack_size is rounded up to the smallest size class, so that stacks of
+// similar sizes share the same bucket of the stack cache.
+// a guard page is allocated in addition to stack_size.
+// on other than Linux, stack_size is ignored by slub_stack
+static size_t
+round_stack_size(size_t stack_size, uint32_t flags)
+{
+    static const size_t classes[] = {GT_STACK_16K, GT_STACK_64K, GT_STACK_256K, GT_STACK_4M};
+
+    if (! (flags & GT_STACK_EXACT)) {
+        for (auto c: classes) {
+            if (stack_size <= c)
+                return c;
+        }
+    }
+
+    return stack_size;
+}
+
+int64_t
+spawn_green_thread_ex(void (*func)(void*), void *arg, size_t stack_size, uint32_t flags)
+{
+    return lunar_gt->spawn(func, arg, round_stack_size(stack_size, flags));
+}
+
+void*
+spawn_joinable_green_thread(void *(*func)(void*), void *arg, size_t stack_size, uint32_t flags)
+{
+    return lunar_gt->spawn_joinable(func, arg, round_stack_size(stack_size, flags));
+}
+
+bool
+join_green_thread(void *handle, int64_t timeout, void **result)
+{
+    return lunar_gt->join(handle, timeout * 1000, result);
+}
+
+void
+detach_green_thread(void *handle)
+{
+    green_thread::detach(handle);
+}
+
+void
+run_green_thread()
+{
+    lunar_gt->run();
+
+    {
+        rtm_transaction tr(lock_thread2gt);
+        thread2gt.erase(get_thread_id());
+    }
+
+    // run contexts donated before the above deregistration
+    lunar_gt->m_is_steal = false;
+    while (lunar_gt->adopt_stolen())
+        lunar_gt->run();
+
+    // the handler of GT_PREEMPT_SIGNAL must not see the deleted scheduler
+    auto gt = lunar_gt;
+    lunar_gt = nullptr;
+    delete gt;
+}
+
+void
+set_stack_cache_green_thread(size_t bytes)
+{
+#ifdef __linux__
+    lunar_gt->set_stack_cache(bytes);
+#endif // __linux__
+}
+
+// stacks are carved out of MAP_NORESERVE regions of num_stacks slots.
+// green threads on them are not stolen by the other schedulers
+bool
+reserve_stack_green_thread(size_t num_stacks, bool is_guard)
+{
+#ifdef __linux__
+    return lunar_gt->reserve_stack(num_stacks, is_guard);
+#else
+    return false;
+#endif // __linux__
+}
+
+bool
+enable_steal_green_thread()
+{
+#ifdef __linux__
+    lunar_gt->enable_steal();
+    return true;
+#else
+    // stacks are allocated by per-thread slub_stack
+    return false;
+#endif // __linux__
+}
+
+#ifdef KQUEUE
+void
+select_green_thread(struct kevent *kev, int num_kev,
+                    void * const *stream, int num_stream,
+                    bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(kev, num_kev, stream, num_stream, is_threadq, timeout * 1000);
+}
+
+void
+select_green_thread_us(struct kevent *kev, int num_kev,
+                       void * const *stream, int num_stream,
+                       bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(kev, num_kev, stream, num_stream, is_threadq, timeout);
+}
+
+void
+select_join_green_thread(struct kevent *kev, int num_kev,
+                         void * const *stream, int num_stream,
+                         void * const *join, int num_join,
+                         bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(kev, num_kev, stream, num_stream, is_threadq, timeout * 1000,
+                            join, num_join);
+}
+#elif (defined EPOLL)
+void
+select_green_thread(epoll_event *eev, int num_eev,
+                    void * const *stream, int num_stream,
+                    bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(eev, num_eev, stream, num_stream, is_threadq, timeout * 1000);
+}
+
+void
+select_green_thread_us(epoll_event *eev, int num_eev,
+                       void * const *stream, int num_stream,
+                       bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(eev, num_eev, stream, num_stream, is_threadq, timeout);
+}
+
+void
+select_join_green_thread(epoll_event *eev, int num_eev,
+                         void * const *stream, int num_stream,
+                         void * const *join, int num_join,
+                         bool is_threadq, int64_t timeout)
+{
+    lunar_gt->select_stream(eev, num_eev, stream, num_stream, is_threadq, timeout * 1000,
+                            join, num_join);
+}
+#endif // KQUEUE
+
+STRM_RESULT
+push_threadq_green_thread(void *thq, char *p)
+{
+    // the thread queue may be pushed by threads other than green threads
+    if (lunar_gt)
+        lunar_gt->preempt_point();
+
+    return ((green_thread::threadq*)thq)->push(p);
+}
+
+STRM_RESULT
+pop_threadq_green_thread(char *p)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->pop_threadq(p);
+}
+
+int
+push_threadq_many_green_thread(void *thq, char *p, int n)
+{
+    if (lunar_gt)
+        lunar_gt->preempt_point();
+
+    return ((green_thread::threadq*)thq)->push_many(p, n);
+}
+
+int
+pop_threadq_many_green_thread(char *p, int max)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->pop_threadq_many(p, max);
+}
+
+STRM_RESULT
+pop_stream_ptr(void *p, void **data)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->pop_stream<void*>((shared_stream*)p, *data);
+}
+
+STRM_RESULT
+pop_stream_bytes(void *p, char *data)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->pop_streamN<char>((shared_stream*)p, data);
+}
+
+STRM_RESULT
+push_stream_ptr(void *p, void *data)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->push_stream<void*>((shared_stream*)p, data);
+}
+
+STRM_RESULT
+push_stream_bytes(void *p, char *data)
+{
+    lunar_gt->preempt_point();
+    return get_lunar_gt()->push_streamN<char>((shared_stream*)p, data);
+}
+
+void
+push_stream_eof(void *p)
+{
+    lunar_gt->push_eof_stream<void*>((shared_stream*)p);
+}
+
+void
+get_fds_ready_green_thread(fdevent_green_thread **events, ssize_t *len)
+{
+    lunar_gt->get_fds_ready(events, len);
+}
+
+} // extern "C"
+
+template<typename T>
+STRM_RESULT
+green_thread::pop_stream(shared_stream *p, T &ret)
+{
+    assert(p->flag & shared_stream::READ);
+
+    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+
+    auto result = q->pop(&ret);
+
+    assert(result != STRM_NO_VACANCY);
+
+    return result;
+}
+
+template<typename T>
+STRM_RESULT
+green_thread::pop_streamN(shared_stream *p, T *ret)
+{
+    assert(p->flag & shared_stream::READ);
+
+    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+
+    auto result = q->popN(ret);
+
+    assert(result != STRM_NO_VACANCY);
+
+    return result;
+}
+
+#define NOTIFY_STREAM(STREAM, QUEUE)                                           \
+    do {                                                                       \
+        auto it = m_wait_stream.find(QUEUE);                                   \
+        if (it != m_wait_stream.end()) {                                       \
+            it->second->m_state |= context::SUSPENDING;                        \
+            it->second->m_ev_stream.push_back(STREAM->shared_data->readstrm);  \
+            m_suspend.push_back(it->second);                                   \
+            TRACE_GT(TRACE_WAKE, it->second->m_id, TRACE_STREAM);              \
+            m_wait_stream.erase(it);                                           \
+        }                                                                      \
+    } while (0)
+
+template<typename T>
+STRM_RESULT
+green_thread::push_stream(shared_stream *p, T data)
+{
+    assert(p->flag & shared_stream::WRITE);
+
+    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+
+    if (p->shared_data->flag_shared & shared_stream::CLOSED_READ || q->is_eof()) {
+        NOTIFY_STREAM(p, q);
+        return STRM_CLOSED;
+    }
+
+    auto result = q->push(&data);
+    if (result == STRM_SUCCESS) {
+        NOTIFY_STREAM(p, q);
+    }
+
+    return result;
+}
+
+template<typename T>
+STRM_RESULT
+green_thread::push_streamN(shared_stream *p, T *data)
+{
+    assert(p->flag & shared_stream::WRITE);
+
+    ringq<T> *q = (ringq<T>*)p->shared_data->stream.ptr;
+
+    if (p->shared_data->flag_shared & shared_stream::CLOSED_READ || q->is_eof()) {
+        NOTIFY_STREAM(p, q);
+        return STRM_CLOSED;
+    }
+
+    auto result = q->pushN(data);
+    if (result == STRM_SUCCESS) {
+        NOTIFY_STREAM(p, q);
+    }
+
+    return result;
+}
+
+template<typename T>
+void
+green_thread::push_eof_stream(shared_stream *p)
 {
     assert(p->flag & shared_stream::WRITE);
 
@@ -339,12 +930,48 @@ green_thread::push_eof_stream(shared_stream *p)
 }
 
 green_thread::green_thread(int qsize, int vecsize)
-    : m_count(0),
+    : m_sp(nullptr),
       m_running(nullptr),
       m_wait_thq(nullptr),
+      m_timeout(get_clock_us()),
       m_threadq(new (make_shared_type(sizeof(*m_threadq))) threadq(qsize, vecsize)),
-      m_pagesize(sysconf(_SC_PAGE_SIZE))
+      m_max_events(DEFAULT_MAX_EVENTS),
+      m_num_wait_io(0),
+#ifdef LUNAR_URING
+      m_uring(nullptr),
+      m_uring_deadline(0),
+#endif // LUNAR_URING
+      m_idle_spin_ns(0),
+      m_idle_yield_ns(0),
+      m_cpu(-1),
+      m_numa_node(-1),
+      m_num_wait_join(0),
+      m_num_remote_join(0),
+      m_num_wait_sync(0),
+      m_is_posted(false),
+      m_is_shutdown(false),
+      m_is_resident(false),
+      m_is_steal(false),
+      m_steal_req(0),
+      m_steal_victim(0),
+      m_steal_idx(0),
+#ifdef __linux__
+      m_stack_pool(sysconf(_SC_PAGE_SIZE)),
+#endif // __linux__
+      m_pagesize(sysconf(_SC_PAGE_SIZE)),
+      m_stats(),
+      m_is_accounting(false),
+      m_resume_tsc(0),
+      m_is_preempt(false),
+      m_preempt_seq(0)
+#ifdef __linux__
+      , m_is_preempt_timer(false)
+#endif // __linux__
 {
+#ifdef LUNAR_TRACE
+    m_trace = trace_buffer::create(thread_id);
+#endif // LUNAR_TRACE
+
 #ifdef KQUEUE
     for (;;) {
         m_kq = kqueue();
@@ -356,6 +983,19 @@ green_thread::green_thread(int qsize, int vecsize)
             break;
         }
     }
+
+    // the pipe of the thread queue is registered only once
+    struct kevent kev;
+    EV_SET(&kev, m_threadq->get_read_fd(), EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    for (;;) {
+        if (kevent(m_kq, &kev, 1, nullptr, 0, nullptr) == -1) {
+            if (errno == EINTR) continue;
+            PRINTERR("failed kevent!: %s", strerror(errno));
+            exit(-1);
+        } else {
+            break;
+        }
+    }
 #elif (defined EPOLL)
     for (;;) {
         m_epoll = epoll_create(32);
@@ -367,13 +1007,36 @@ green_thread::green_thread(int qsize, int vecsize)
             break;
         }
     }
+
+    // the eventfd of the thread queue is registered only once
+    epoll_event eev;
+    eev.data.fd = m_threadq->get_read_fd();
+    eev.events  = EPOLLIN | EPOLLET;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, eev.data.fd, &eev) == -1) {
+        PRINTERR("failed epoll_ctl!: %s", strerror(errno));
+        exit(-1);
+    }
 #endif // KQUEUE
 }
 
 green_thread::~green_thread()
 {
+#ifdef __linux__
+    if (m_is_preempt_timer)
+        timer_delete(m_preempt_timer);
+#endif // __linux__
+
     deref_shared_type(m_threadq);
 
+    m_id2context.for_each([](context *ctx) { delete ctx; });
+
+    for (auto ctx: m_free_context)
+        delete ctx;
+
+#ifdef LUNAR_URING
+    delete m_uring;
+#endif // LUNAR_URING
+
 #ifdef KQUEUE
     for (;;) {
         if (close(m_kq) == -1) {
@@ -397,357 +1060,708 @@ green_thread::~green_thread()
 #endif // KQUEUE
 }
 
+#ifdef EPOLL
+// usec < 0 means infinity.
+// epoll_wait() takes milliseconds, so epoll_pwait2() is used if available
+static int
+epoll_wait_us(int epfd, epoll_event *eev, int size, int64_t usec)
+{
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+    static volatile bool is_pwait2 = true;
+
+    if (is_pwait2) {
+        timespec tm;
+        tm.tv_sec  = usec / 1000000;
+        tm.tv_nsec = (usec % 1000000) * 1000;
+
+        int ret = epoll_pwait2(epfd, eev, size, usec < 0 ? nullptr : &tm, nullptr);
+        if (ret != -1 || errno != ENOSYS)
+            return ret;
+
+        is_pwait2 = false; // the kernel is older than 5.11
+    }
+#endif
+#endif // __GLIBC_PREREQ
+
+    // round up not to wake up before timeouts
+    return epoll_wait(epfd, eev, size, usec < 0 ? -1 : (usec + 999) / 1000);
+}
+#endif // EPOLL
+
 void
 green_thread::select_fd(bool is_block)
 {
-#ifdef KQUEUE
-    auto size = m_wait_fd.size();
-    struct kevent *kev = new struct kevent[size + 1];
+    m_stats.num_select_fd++;
 
-    int ret;
+    // timeout in microseconds, and -1 means infinity.
+    // the kernel sleeps even if no file descriptor is waited, so that
+    // timeouts are handled by the same path
+    int64_t usec = 0;
 
     if (is_block) {
         if (m_timeout.empty()) {
-            ret = kevent(m_kq, nullptr, 0, kev, size, nullptr);
+            usec = is_polling() ? STEAL_INTERVAL * 1000 : -1;
         } else {
-            auto &tout = m_timeout.get<0>();
-            auto it = tout.begin();
-
-            uint64_t clock = lunar_clock;
-
-            if (clock >= it->m_clock) {
-                timespec tm;
-                tm.tv_sec  = 0;
-                tm.tv_nsec = 0;
-                for (;;) {
-                    ret = kevent(m_kq, nullptr, 0, kev, size, &tm);
-                    if (ret == -1) {
-                        if (errno == EINTR) continue;
-                        PRINTERR("failed kevent!: %s", strerror(errno));
-                        exit(-1);
-                    } else {
-                        break;
-                    }
-                }
-            } else {
-                intptr_t msec = it->m_clock - clock;
-
-                assert(msec > 0);
-
-                if (size > 0) {
-                    timespec tm;
-                    tm.tv_sec = msec * 1e-3;
-                    tm.tv_nsec = (msec - tm.tv_sec * 1e3) * 1e-6;
-                    for (;;) {
-                        ret = kevent(m_kq, nullptr, 0, kev, size, &tm);
-                        if (ret == -1) {
-                            if (errno == EINTR) continue;
-                            PRINTERR("failed kevent!: %s", strerror(errno));
-                            exit(-1);
-                        } else {
-                            break;
-                        }
-                    }
-                } else {
-                    ret = 0;
-                    usleep(msec * 1000);
+            uint64_t next  = m_timeout.next_expiry();
+            uint64_t clock = get_clock_us();
+
+            usec = clock >= next ? 0 : next - clock;
+
+            if (is_polling() && usec > STEAL_INTERVAL * 1000)
+                usec = STEAL_INTERVAL * 1000;
+        }
+    }
+
+#ifdef KQUEUE
+    // the event buffer is reused, and grows up to m_max_events.
+    // events which do not fit are left in the kernel, which returns them
+    // by the next call before the events occurring later, so that busy
+    // file descriptors cannot starve the others
+    size_t size = m_wait_fd.size() + 1;
+    if (size > (size_t)m_max_events)
+        size = m_max_events;
+
+    if (m_kev.size() < size)
+        m_kev.resize(size);
+
+    struct kevent *kev = &m_kev[0];
+
+    timespec tm;
+    tm.tv_sec  = usec / 1000000;
+    tm.tv_nsec = (usec % 1000000) * 1000;
+
+    int ret = kevent(m_kq, nullptr, 0, kev, size, usec < 0 ? nullptr : &tm);
+    if (ret == -1) {
+        if (errno != EINTR) {
+            PRINTERR("failed kevent!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        ret = 0; // the scheduler will call select_fd again
+    }
+
+    for (int i = 0; i < ret; i++) {
+        if (kev[i].flags & EV_ERROR) { // report any error
+            PRINTERR("error on kevent: %s\n", strerror(kev[i].data));
+            continue;
+        }
+
+        // invoke the green_thread waiting the thread queue
+        // (see select_epoll())
+        if (kev[i].ident == (uintptr_t)m_threadq->get_read_fd() && kev[i].filter == EVFILT_READ) {
+            assert(! (kev[i].flags & EV_EOF));
+            m_threadq->drain_fd();
+
+            if (m_wait_thq && m_threadq->get_wait_type() == threadq::QWAIT_PIPE &&
+                m_threadq->is_ready()) {
+                if (! (m_wait_thq->m_state & context::SUSPENDING)) {
+                    m_wait_thq->m_state |= context::SUSPENDING;
+                    m_suspend.push_back(m_wait_thq);
+                    TRACE_GT(TRACE_WAKE, m_wait_thq->m_id, TRACE_THQ);
                 }
+
+                m_threadq->set_wait_type(threadq::QWAIT_NONE);
+                m_wait_thq = nullptr;
             }
+
+            continue;
         }
-    } else {
-        timespec tm;
-        tm.tv_sec  = 0;
-        tm.tv_nsec = 0;
-        for (;;) {
-            ret = kevent(m_kq, nullptr, 0, kev, size, &tm);
-            if (ret == -1) {
-                if (errno == EINTR) continue;
-                PRINTERR("failed kevent!: %s", strerror(errno));
-                exit(-1);
-            } else {
-                break;
+
+        auto it = m_wait_fd.find({kev[i].ident, kev[i].filter});
+
+        assert (it != m_wait_fd.end());
+
+        // invoke the green_threads waiting the file descriptors
+        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            if (! ((*it2)->m_state & context::SUSPENDING)) {
+                (*it2)->m_state |= context::SUSPENDING;
+                m_suspend.push_back(*it2);
+                TRACE_GT(TRACE_WAKE, (*it2)->m_id, TRACE_FD);
             }
+            (*it2)->m_events.push_back({it->first.m_fd, it->first.m_event, kev[i].flags, kev[i].fflags, kev[i].data});
+        }
+
+        m_wait_fd.erase(it);
+    }
+#elif (defined EPOLL)
+#ifdef LUNAR_URING
+    if (m_uring) {
+        select_uring(is_block, usec);
+        return;
+    }
+#endif // LUNAR_URING
+
+    select_epoll(usec);
+#endif // KQUEUE
+}
+
+#ifdef EPOLL
+void
+green_thread::select_epoll(int64_t usec)
+{
+    // the event buffer is reused (see select_fd() for kqueue)
+    size_t size = m_wait_fd.size() + 1;
+    if (size > (size_t)m_max_events)
+        size = m_max_events;
+
+    if (m_eev.size() < size)
+        m_eev.resize(size);
+
+    epoll_event *eev = &m_eev[0];
+
+    int ret = epoll_wait_us(m_epoll, eev, size, usec);
+    if (ret == -1) {
+        if (errno != EINTR) {
+            PRINTERR("failed epoll_wait!: %s", strerror(errno));
+            exit(-1);
         }
+
+        ret = 0; // the scheduler will call select_fd again
     }
 
     for (int i = 0; i < ret; i++) {
-        if (kev[i].flags & EV_ERROR) { // report any error
-            PRINTERR("error on kevent: %s\n", strerror(kev[i].data));
+        int fd = eev[i].data.fd;
+
+        // invoke the green_thread waiting the thread queue.
+        // the eventfd may be notified after the wait has been finished
+        // by other events, or by notify_post(), and then it is only drained
+        if (fd == m_threadq->get_read_fd()) {
+            m_threadq->drain_fd();
+
+            if (m_wait_thq && m_threadq->get_wait_type() == threadq::QWAIT_PIPE &&
+                m_threadq->is_ready()) {
+                if (! (m_wait_thq->m_state & context::SUSPENDING)) {
+                    m_wait_thq->m_state |= context::SUSPENDING;
+                    m_suspend.push_back(m_wait_thq);
+                    TRACE_GT(TRACE_WAKE, m_wait_thq->m_id, TRACE_THQ);
+                }
+
+                m_threadq->set_wait_type(threadq::QWAIT_NONE);
+                m_wait_thq = nullptr;
+            }
+
+            continue;
+        }
+
+        if ((size_t)fd >= m_fd_flags.size() || ! (m_fd_flags[fd] & FD_REGISTERED))
             continue;
+
+        // errors and hang-ups are reported to both directions
+        if (eev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            wake_fd(fd, EPOLLIN, FD_READY_IN);
+
+        if (eev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            wake_fd(fd, EPOLLOUT, FD_READY_OUT);
+    }
+}
+#endif // EPOLL
+
+#ifdef LUNAR_URING
+bool
+green_thread::enable_uring()
+{
+    auto r = new uring;
+    if (! r->init(URING_ENTRIES)) {
+        delete r;
+        return false;
+    }
+
+    m_uring = r;
+    poll_epoll();
+
+    return true;
+}
+
+// wait for the epoll descriptor by the ring, which is re-armed after
+// every completion
+void
+green_thread::poll_epoll()
+{
+    auto sqe = get_sqe();
+
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = m_epoll;
+    sqe->poll_events = POLLIN;
+    sqe->user_data   = URING_EPOLL;
+}
+
+io_uring_sqe*
+green_thread::get_sqe()
+{
+    for (;;) {
+        auto sqe = m_uring->get_sqe();
+        if (sqe)
+            return sqe;
+
+        // the submission queue is full
+        m_stats.num_io_submits++;
+        if (! m_uring->enter(0, 0)) {
+            PRINTERR("failed io_uring_enter!: %s", strerror(errno));
+            exit(-1);
+        }
+    }
+}
+
+int32_t
+green_thread::wait_io(io_uring_sqe *sqe)
+{
+    io_request req;
+    req.m_ctx = m_running;
+    req.m_res = 0;
+
+    sqe->user_data = (uint64_t)&req;
+
+    // submit after the contexts which are runnable now
+    if (m_uring->num_unsubmitted() == 1)
+        m_uring_deadline = m_stats.num_switches + m_suspend.size() + 1;
+
+    m_running->m_state = context::WAITING_IO;
+    m_num_wait_io++;
+    m_stats.num_io_ops++;
+
+    // waiting contexts are never donated, so this scheduler resumes it
+    schedule();
+
+    return req.m_res;
+}
+
+void
+green_thread::select_uring(bool is_block, int64_t usec)
+{
+    bool is_submit = m_uring->num_unsubmitted() > 0 &&
+                     (is_block || m_suspend.empty() || m_stats.num_switches >= m_uring_deadline);
+    unsigned wait_nr = (is_block && ! m_uring->has_cqe()) ? 1 : 0;
+
+    if (is_submit || wait_nr > 0) {
+        if (is_submit)
+            m_stats.num_io_submits++;
+
+        if (! m_uring->enter(wait_nr, usec)) {
+            PRINTERR("failed io_uring_enter!: %s", strerror(errno));
+            exit(-1);
         }
+    }
+
+    bool is_epoll = false;
+
+    m_uring->reap([&](uint64_t data, int32_t res) {
+        if (data == URING_EPOLL) {
+            is_epoll = true;
+            return;
+        }
+
+        auto req = (io_request*)data;
+        auto ctx = req->m_ctx;
+
+        req->m_res = res;
+        m_num_wait_io--;
+
+        ctx->m_state |= context::SUSPENDING;
+        m_suspend.push_back(ctx);
+        TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_IO);
+    });
+
+    if (is_epoll) {
+        poll_epoll();
+        select_epoll(0);
+    }
+}
+#endif // LUNAR_URING
+
+int64_t
+green_thread::spawn(void (*func)(void*), void *arg, size_t stack_size)
+{
+    context *ctx;
+
+    if (m_free_context.empty()) {
+        ctx = new context;
+    } else {
+        ctx = m_free_context.back();
+        m_free_context.pop_back();
+    }
+
+    // a guard page in addition to stack_size
+    size_t pagesize = m_pagesize;
+    stack_size += pagesize;
+    stack_size -= stack_size % pagesize;
+
+    if (stack_size < pagesize * 2)
+        stack_size = pagesize * 2;
+
+    ctx->m_id    = insert_context(ctx);
+    ctx->m_state = context::READY;
+    ctx->m_is_ev_thq     = false;
+    ctx->m_is_ev_timeout = false;
+    ctx->m_timer.m_data  = ctx;
+    ctx->m_join          = nullptr;
+    ctx->m_is_remote_join = false;
+    ctx->m_is_cancelled  = false;
+    ctx->m_is_nocancel   = false;
+    ctx->m_num_resumes   = 0;
+    ctx->m_run_cycles    = 0;
+    memset(ctx->m_gls, 0, sizeof(ctx->m_gls));
+
+#ifdef __linux__
+    ctx->m_stack = (uint64_t*)m_stack_pool.allocate(stack_size);
+    ctx->m_stack_size = stack_size / sizeof(uint64_t);
+
+    auto top = &ctx->m_stack[ctx->m_stack_size];
+#else
+    ctx->m_stack = (uint64_t*)m_slub_stack.allocate();
+
+    auto top = ctx->m_stack;
+#endif // __linux__
+
+    uint32_t mxcsr;
+    uint16_t cw;
+    asm volatile ("stmxcsr %0; fnstcw %1" : "=m"(mxcsr), "=m"(cw));
+
+    top[-1] = (uint64_t)cw << 32 | mxcsr; // x87 CW, MXCSR
+    top[-2] = (uint64_t)ctx;       // push context
+    top[-3] = (uint64_t)arg;       // push argument
+    top[-4] = (uint64_t)func;      // push func
+
+    // initial frame for lunar_swap_context, which returns to ___INVOKE
+    top[-5]  = (uint64_t)___INVOKE; // return address
+    top[-6]  = 0;                   // %rbp
+    top[-7]  = 0;                   // %rbx
+    top[-8]  = 0;                   // %r12
+    top[-9]  = 0;                   // %r13
+    top[-10] = 0;                   // %r14
+    top[-11] = 0;                   // %r15
+    ctx->m_sp = &top[-11];
+
+    m_suspend.push_back(ctx);
+    m_stats.num_spawns++;
+    TRACE_GT(TRACE_SPAWN, ctx->m_id, 0);
+
+    return ctx->m_id;
+}
+
+void
+green_thread::run()
+{
+    // schedule() returns after all contexts have been stopped
+    schedule();
+
+    if (! m_stop.empty())
+        remove_stopped();
+
+    m_running = nullptr;
+}
+
+void*
+green_thread::spawn_joinable(void *(*func)(void*), void *arg, size_t stack_size)
+{
+    auto h  = new join_handle(this, func, arg);
+    auto id = spawn(invoke_joinable, h, stack_size);
+
+    m_id2context.find(id)->m_join = h;
+
+    return h;
+}
+
+// the entry of joinable green threads. the handle is alive until finish()
+void
+green_thread::invoke_joinable(void *arg)
+{
+    auto h = (join_handle*)arg;
+    h->m_result = h->m_func(h->m_arg);
+}
 
-        // invoke the green_thread waiting the thread queue
-        if (m_wait_thq && m_threadq->get_wait_type() == threadq::QWAIT_PIPE &&
-            kev[i].ident == (uintptr_t)m_threadq->get_read_fd() && kev[i].filter == EVFILT_READ) {
+bool
+green_thread::join(void *handle, int64_t timeout, void **result)
+{
+    auto h = (join_handle*)handle;
+    bool is_done;
 
-            if (! (m_wait_thq->m_state & context::SUSPENDING)) {
-                m_wait_thq->m_state |= context::SUSPENDING;
-                m_suspend.push_back(m_wait_thq);
-            }
+    {
+        spin_lock_acquire lock(h->m_lock);
+        is_done = h->m_is_done;
+    }
 
-            m_threadq->set_wait_type(threadq::QWAIT_NONE);
-            m_wait_thq = nullptr;
+    if (! is_done)
+        select_stream(nullptr, 0, nullptr, 0, false, timeout, &handle, 1);
 
-            assert(! (kev[i].flags & EV_EOF));
-            m_threadq->pop_pipe(kev[i].data);
+    // this context may be resumed by another scheduler, so "this" is not used
+    {
+        spin_lock_acquire lock(h->m_lock);
+        if (! h->m_is_done)
+            return false;
 
-            continue;
-        }
+        if (result)
+            *result = h->m_result;
+    }
 
-        auto it = m_wait_fd.find({kev[i].ident, kev[i].filter});
+    detach(h);
 
-        assert (it != m_wait_fd.end());
+    return true;
+}
 
-        // invoke the green_threads waiting the file descriptors
-        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            if (! ((*it2)->m_state & context::SUSPENDING)) {
-                (*it2)->m_state |= context::SUSPENDING;
-                m_suspend.push_back(*it2);
-            }
-            (*it2)->m_events.push_back({it->first.m_fd, it->first.m_event, kev[i].flags, kev[i].fflags, kev[i].data});
-        }
+void
+green_thread::detach(void *handle)
+{
+    auto h = (join_handle*)handle;
+    if (__sync_sub_and_fetch(&h->m_ref, 1) == 0)
+        delete h;
+}
 
-        m_wait_fd.erase(it);
-    }
+void
+green_thread::finish(void *ctx)
+{
+    auto c = (context*)ctx;
 
-    delete[] kev;
-#elif (defined EPOLL)
-    auto size = m_wait_fd.size();
-    epoll_event *eev = new epoll_event[size];
+    c->m_state = context::STOP;
 
-    int ret;
+    if (c->m_join) {
+        auto h = c->m_join;
 
-    if (is_block) {
-        if (m_timeout.empty()) {
-            ret = epoll_wait(m_epoll, eev, size, -1);
-        } else {
-            auto &tout = m_timeout.get<0>();
-            auto it = tout.begin();
-
-            uint64_t clock = lunar_clock;
-
-            if (clock >= it->m_clock) {
-                for (;;) {
-                    ret = epoll_wait(m_epoll, eev, size, 0);
-                    if (ret == -1) {
-                        if (errno == EINTR) continue;
-                        PRINTERR("failed kevent!: %s", strerror(errno));
-                        exit(-1);
-                    } else {
-                        break;
-                    }
-                }
-            } else {
-                intptr_t msec = it->m_clock - clock;
-
-                assert(msec > 0);
-
-                if (size > 0) {
-                    for (;;) {
-                        ret = epoll_wait(m_epoll, eev, size, msec);
-                        if (ret == -1) {
-                            if (errno == EINTR) continue;
-                            PRINTERR("failed kevent!: %s", strerror(errno));
-                            exit(-1);
-                        } else {
-                            break;
-                        }
-                    }
+        {
+            spin_lock_acquire lock(h->m_lock);
+            h->m_is_done = true;
+
+            if (h->m_waiter) {
+                if (h->m_waiter_gt == this) {
+                    wake_join(h->m_waiter, h);
                 } else {
-                    ret = 0;
-                    usleep(msec * 1000);
-                }
-            }
-        }
-    } else {
-        for (;;) {
-            ret = epoll_wait(m_epoll, eev, size, 0);
-            if (ret == -1) {
-                if (errno == EINTR) continue;
-                PRINTERR("failed kevent!: %s", strerror(errno));
-                exit(-1);
-            } else {
-                break;
-            }
-        }
-    }
+                    // h->m_waiter_gt is alive while h->m_waiter is registered
+                    auto gt = h->m_waiter_gt;
+                    __sync_fetch_and_add(&h->m_ref, 1);
 
-    auto func = [&](int fd, uint32_t event) {
-        auto it = m_wait_fd.find({fd, event});
-        assert(it != m_wait_fd.end());
+                    {
+                        spin_lock_acquire lock2(gt->m_post_lock);
+                        gt->m_posted_join.push_back(h);
+                        gt->m_is_posted = true;
+                    }
 
-        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            if (! ((*it2)->m_state & context::SUSPENDING)) {
-                (*it2)->m_state |= context::SUSPENDING;
-                m_suspend.push_back(*it2);
+                    gt->notify_post();
+                }
             }
-            (*it2)->m_events.push_back({it->first.m_fd, it->first.m_event, 0, 0, 0});
         }
 
-        m_wait_fd.erase(it);
-    };
+        c->m_join = nullptr;
+        detach(h);
+    }
 
-    for (int i = 0; i < ret; i++) {
-        // invoke the green_thread waiting the thread queue
-        if (m_wait_thq && m_threadq->get_wait_type() == threadq::QWAIT_PIPE &&
-            eev[i].data.fd == m_threadq->get_read_fd() && (eev[i].events & EPOLLIN)) {
+    schedule();
+}
 
-            if (! (m_wait_thq->m_state & context::SUSPENDING)) {
-                m_wait_thq->m_state |= context::SUSPENDING;
-                m_suspend.push_back(m_wait_thq);
-            }
+void
+green_thread::wake_join(context *ctx, join_handle *h)
+{
+    ctx->m_ev_join.push_back(h);
 
-            m_threadq->set_wait_type(threadq::QWAIT_NONE);
-            m_wait_thq = nullptr;
+    if (! (ctx->m_state & context::SUSPENDING)) {
+        ctx->m_state |= context::SUSPENDING;
+        m_suspend.push_back(ctx);
+        TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_JOIN);
+    }
+}
 
-            m_threadq->pop_pipe(1);
+void
+green_thread::resume_posted()
+{
+    std::vector<join_handle*> posted;
+    std::vector<gt_waiter*>   posted_sync;
+    std::vector<std::pair<void (*)(void*), void*>> posted_spawn;
 
-            continue;
-        }
+    {
+        spin_lock_acquire lock(m_post_lock);
+        posted.swap(m_posted_join);
+        posted_sync.swap(m_posted_sync);
+        posted_spawn.swap(m_posted_spawn);
+        m_is_posted = false;
+
+        if (m_is_shutdown)
+            m_is_resident = false;
+    }
 
-        if (eev[i].events & EPOLLIN) {
-            func(eev[i].data.fd, EPOLLIN);
-        }
+    for (auto &p: posted_spawn)
+        spawn(p.first, p.second, GT_STACK_4M);
 
-        if (eev[i].events & EPOLLOUT) {
-            func(eev[i].data.fd, EPOLLOUT);
+    for (auto h: posted) {
+        {
+            spin_lock_acquire lock(h->m_lock);
+            if (h->m_waiter && h->m_waiter_gt == this)
+                wake_join(h->m_waiter, h);
         }
 
-        auto it_in  = m_wait_fd.find({eev[i].data.fd, EPOLLIN});
-        auto it_out = m_wait_fd.find({eev[i].data.fd, EPOLLOUT});
-
-        epoll_event eev2;
-        if (it_in == m_wait_fd.end() && it_out == m_wait_fd.end()) {
-            for (;;) {
-                if (epoll_ctl(m_epoll, EPOLL_CTL_DEL, eev[i].data.fd, nullptr) < -1) {
-                    if (errno == EINTR) continue;
-                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                    exit(-1);
-                } else {
-                    break;
-                }
-            }
-        } else if (it_in != m_wait_fd.end()) {
-            eev2.events  = EPOLLIN;
-            eev2.data.fd = eev[i].data.fd;
-            for (;;) {
-                if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, eev[i].data.fd, &eev2) < -1) {
-                    if (errno == EINTR) continue;
-                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                    exit(-1);
-                }
-            }
-        } else {
-            eev2.events  = EPOLLOUT;
-            eev2.data.fd = eev[i].data.fd;
-            for (;;) {
-                if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, eev[i].data.fd, &eev2) < -1) {
-                    if (errno == EINTR) continue;
-                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                    exit(-1);
-                }
-            }
-        }
+        detach(h);
     }
 
-    delete[] eev;
-#endif // KQUEUE
+    // the waiters are still parked, because they wait m_is_signaled
+    for (auto w: posted_sync)
+        wake_sync(w);
 }
 
-int
-green_thread::spawn(void (*func)(void*), void *arg, int stack_size)
+// wake this scheduler sleeping on the condition variable or in
+// select_fd() to handle posts
+void
+green_thread::notify_post()
 {
-    auto ctx = std::unique_ptr<context>(new context);
+    m_threadq->wake();
+    m_threadq->notify_fd();
+}
 
-    for (;;) {
-        ++m_count;
-        if (m_count > 0) {
-            if (m_id2context.find(m_count) == m_id2context.end())
-                break;
-            else
-                continue;
-        } else {
-            m_count = 1;
-        }
+void
+green_thread::post_spawn(void (*func)(void*), void *arg)
+{
+    {
+        spin_lock_acquire lock(m_post_lock);
+        m_posted_spawn.push_back(std::make_pair(func, arg));
+        m_is_posted = true;
     }
 
-    stack_size += m_pagesize;
-    stack_size -= stack_size % m_pagesize;
+    notify_post();
+}
 
-    if (stack_size < m_pagesize * 2)
-        stack_size = m_pagesize * 2;
+void
+green_thread::post_shutdown()
+{
+    {
+        spin_lock_acquire lock(m_post_lock);
+        m_is_shutdown = true;
+        m_is_posted   = true;
+    }
 
-    ctx->m_id    = m_count;
-    ctx->m_state = context::READY;
+    notify_post();
+}
 
-#ifdef __linux__
-    void *addr;
+void
+green_thread::park(gt_waiter *w, int64_t timeout, spin_lock_acquire_unsafe &lock,
+                   bool is_cancellable)
+{
+    w->m_ctx         = m_running;
+    w->m_gt          = this;
+    w->m_is_signaled = false;
 
-    if (posix_memalign(&addr, m_pagesize, stack_size) != 0) {
-        PRINTERR("failed posix_memalign!: %s", strerror(errno));
-        exit(-1);
+    if (is_cancellable && m_running->m_is_cancelled) {
+        lock.unlock();
+        return;
     }
 
-    ctx->m_stack = (uint64_t*)addr;
-    ctx->m_stack_size = stack_size / sizeof(uint64_t);
-
-    auto s = ctx->m_stack_size;
-    ctx->m_stack[s - 2] = (uint64_t)ctx.get(); // push context
-    ctx->m_stack[s - 3] = (uint64_t)arg;       // push argument
-    ctx->m_stack[s - 4] = (uint64_t)func;      // push func
+    m_running->m_state = context::WAITING_SYNC;
+    m_running->m_is_nocancel = ! is_cancellable;
+    m_running->m_is_ev_timeout = false;
 
-    // see /proc/sys/vm/max_map_count for Linux
-    if (mprotect(&ctx->m_stack[0], m_pagesize, PROT_NONE) < 0) {
-        PRINTERR("failed mprotect!: %s", strerror(errno));
-        exit(-1);
+    if (timeout) {
+        m_running->m_state |= context::WAITING_TIMEOUT;
+        m_timeout.insert(&m_running->m_timer, get_clock_us() + (uint64_t)timeout);
     }
-#else
-    ctx->m_stack = (uint64_t*)m_slub_stack.allocate();
 
-    ctx->m_stack[-2] = (uint64_t)ctx.get(); // push context
-    ctx->m_stack[-3] = (uint64_t)arg;       // push argument
-    ctx->m_stack[-4] = (uint64_t)func;      // push func
-#endif // __linux__
+    m_num_wait_sync++;
 
-    m_suspend.push_back(ctx.get());
-    m_id2context[m_count] = std::move(ctx);
+    lock.unlock();
 
-    return m_count;
+    // parked contexts are never donated, so this scheduler resumes it
+    schedule();
 }
 
 void
-green_thread::run()
+green_thread::unpark(gt_waiter *w)
 {
-    if (sigsetjmp(m_jmp_buf, 0) == 0) {
-        schedule();
+    auto gt = w->m_gt;
+
+    if (gt == lunar_gt) {
+        gt->wake_sync(w);
     } else {
-        if (! m_stop.empty())
-            remove_stopped();
+        // notify holding m_post_lock, because gt may exit as soon as the
+        // waiter is resumed
+        spin_lock_acquire lock(gt->m_post_lock);
+        gt->m_posted_sync.push_back(w);
+        gt->m_is_posted = true;
+        gt->notify_post();
     }
 }
 
 void
-green_thread::resume_timeout()
+green_thread::wake_sync(gt_waiter *w)
 {
-    uint64_t now = lunar_clock;
+    auto ctx = (context*)w->m_ctx;
 
-    auto &tout = m_timeout.get<0>();
-    for (auto it = tout.begin(); it != tout.end(); ) {
-        if (it->m_clock > now)
-            break;
+    w->m_is_signaled = true;
+
+    if (! (ctx->m_state & context::SUSPENDING)) {
+        ctx->m_state |= context::SUSPENDING;
+        m_suspend.push_back(ctx);
+        TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_SYNC);
+    }
+}
+
+void
+green_thread::unregister_join(context *ctx)
+{
+    for (auto h: ctx->m_wait_join) {
+        spin_lock_acquire lock(h->m_lock);
+        if (h->m_waiter == ctx) {
+            h->m_waiter    = nullptr;
+            h->m_waiter_gt = nullptr;
+        }
+    }
+
+    ctx->m_wait_join.clear();
+    m_num_wait_join--;
+
+    if (ctx->m_is_remote_join) {
+        ctx->m_is_remote_join = false;
+        m_num_remote_join--;
+    }
+}
+
+bool
+green_thread::cancel(int64_t id)
+{
+    auto ctx = m_id2context.find(id);
+    if (ctx == nullptr)
+        return false;
 
-        it->m_ctx->m_state |= context::SUSPENDING;
-        it->m_ctx->m_is_ev_timeout = true;
-        m_suspend.push_back(it->m_ctx);
+    ctx->m_is_cancelled = true;
 
-        tout.erase(it++);
+    // schedule() removes the context from the wait queues when resuming it
+    if ((ctx->m_state & context::WAITING) && ! (ctx->m_state & context::SUSPENDING) &&
+        ! ((ctx->m_state & context::WAITING_SYNC) && ctx->m_is_nocancel) &&
+        ! (ctx->m_state & context::WAITING_IO)) {
+        ctx->m_state |= context::SUSPENDING;
+        m_suspend.push_back(ctx);
+        TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_CANCEL);
     }
+
+    return true;
+}
+
+void
+green_thread::resume_timeout()
+{
+    m_timeout.advance(get_clock_us(), [&](void *data) {
+        auto ctx = (context*)data;
+        ctx->m_state |= context::SUSPENDING;
+        ctx->m_is_ev_timeout = true;
+        m_suspend.push_back(ctx);
+        m_stats.num_timeouts++;
+        TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_TIMEOUT);
+    });
 }
 
 void
 green_thread::schedule()
 {
-    if (! m_wait_fd.empty())
+    if (m_is_accounting && m_running)
+        m_running->m_run_cycles += rdtsc() - m_resume_tsc;
+
+#ifdef LUNAR_TRACE
+    if (m_running) {
+        auto state = m_running->m_state;
+        if (state == context::STOP)
+            TRACE_GT(TRACE_STOP, m_running->m_id, 0);
+        else if (state & context::WAITING)
+            TRACE_GT(TRACE_BLOCK, m_running->m_id, trace_reason(state));
+        else
+            TRACE_GT(TRACE_YIELD, m_running->m_id, 0);
+    }
+#endif // LUNAR_TRACE
+
+    if (is_waiting_fd())
         select_fd(false);
 
     for (;;) {
@@ -761,16 +1775,24 @@ green_thread::schedule()
             } else if (m_running->m_state == context::STOP) {
                 m_running->m_state = 0;
                 m_stop.push_back(m_running);
+                m_stats.num_stops++;
             }
         }
 
+        if (m_steal_req)
+            donate(ctx);
+
+        if (m_is_posted)
+            resume_posted();
+
         if (! m_timeout.empty())
             resume_timeout();
 
-        if (m_wait_thq && m_threadq->m_qwait_type == threadq::QWAIT_NONE && m_threadq->get_len() > 0) {
+        if (m_wait_thq && m_threadq->m_qwait_type == threadq::QWAIT_NONE && m_threadq->is_ready()) {
             if (! (m_wait_thq->m_state & context::SUSPENDING)) {
                 m_wait_thq->m_state |= context::SUSPENDING;
                 m_suspend.push_back(m_wait_thq);
+                TRACE_GT(TRACE_WAKE, m_wait_thq->m_id, TRACE_THQ);
             }
 
             m_wait_thq->m_is_ev_thq = true;
@@ -785,40 +1807,17 @@ green_thread::schedule()
             m_suspend.pop_front();
 
             if (state & context::READY) {
-                if (ctx) {
-                    if (sigsetjmp(ctx->m_jmp_buf, 0) == 0) {
-#ifdef __linux__
-                        auto p = &m_running->m_stack[m_running->m_stack_size - 4];
-#else
-                        auto p = &m_running->m_stack[-4];
-#endif // __linux__
-                        asm (
-                            "movq %0, %%rsp;" // set stack pointer
-                            "movq %0, %%rbp;" // set frame pointer
-                            "jmp ___INVOKE;"
-                            :
-                            : "r" (p)
-                        );
-                    } else {
-                        if (! m_stop.empty())
-                            remove_stopped();
-
-                        return;
-                    }
-                } else {
-#ifdef __linux__
-                    auto p = &m_running->m_stack[m_running->m_stack_size - 4];
-#else
-                    auto p = &m_running->m_stack[-4];
-#endif // __linux__
-                    asm (
-                        "movq %0, %%rsp;" // set stack pointer
-                        "movq %0, %%rbp;" // set frame pointer
-                        "jmp ___INVOKE;"
-                        :
-                        : "r" (p)
-                    );
-                }
+                resume_stats();
+
+                // ctx is nullptr when called by run() on the scheduler's stack
+                lunar_swap_context(ctx ? &ctx->m_sp : &m_sp, m_running->m_sp);
+
+                // this context may be resumed by another scheduler
+                auto gt = get_lunar_gt();
+                if (! gt->m_stop.empty())
+                    gt->remove_stopped();
+
+                return;
             } else {
                 // remove the context from wait queues
                 if (! m_running->m_fd.empty()) {
@@ -853,9 +1852,7 @@ green_thread::schedule()
 
                     delete[] kev;
 #elif (defined EPOLL)
-                    int fds[m_running->m_fd.size()];
-                    int fdnum = 0;
-
+                    // registrations are kept until close_fd()
                     for (auto &ev: m_running->m_fd) {
                         auto it = m_wait_fd.find(ev);
                         if (it == m_wait_fd.end())
@@ -865,52 +1862,6 @@ green_thread::schedule()
 
                         if (it->second.empty())
                             m_wait_fd.erase(it);
-
-                        fds[fdnum] = ev.m_fd;
-                        fdnum++;
-                    }
-
-                    for (int i = 0; i < fdnum; i++) {
-                        int fd = fds[i];
-                        auto it_in  = m_wait_fd.find({fd, EPOLLIN});
-                        auto it_out = m_wait_fd.find({fd, EPOLLOUT});
-
-                        epoll_event eev;
-                        if (it_in == m_wait_fd.end() && it_out == m_wait_fd.end()) {
-                            for (;;) {
-                                if (epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr) < -1) {
-                                    if (errno == EINTR) continue;
-                                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                                    exit(-1);
-                                } else {
-                                    break;
-                                }
-                            }
-                        } else if (it_in != m_wait_fd.end()) {
-                            eev.events  = EPOLLIN;
-                            eev.data.fd = fd;
-                            for (;;) {
-                                if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &eev) < -1) {
-                                    if (errno == EINTR) continue;
-                                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                                    exit(-1);
-                                } else {
-                                    break;
-                                }
-                            }
-                        } else {
-                            eev.events  = EPOLLOUT;
-                            eev.data.fd = fd;
-                            for (;;) {
-                                if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &eev) < -1) {
-                                    if (errno == EINTR) continue;
-                                    PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                                    exit(-1);
-                                } else {
-                                    break;
-                                }
-                            }
-                        }
                     }
 #endif // KQUEUE
 
@@ -926,169 +1877,192 @@ green_thread::schedule()
                 m_running->m_stream.clear();
 
                 if (state & context::WAITING_TIMEOUT)
-                    m_timeout.get<1>().erase(m_running);
+                    m_timeout.erase(&m_running->m_timer);
 
-                if (state & context::WAITING_THQ) {
+                if (state & context::WAITING_JOIN)
+                    unregister_join(m_running);
+
+                if (state & context::WAITING_SYNC)
+                    m_num_wait_sync--;
 
-                    spin_lock_acquire_unsafe lock(m_threadq->m_qlock);
+                if (state & context::WAITING_THQ) {
+                    // a notification written after this is drained later
                     if (m_threadq->m_qwait_type == threadq::QWAIT_PIPE) {
                         m_threadq->m_qwait_type = threadq::QWAIT_NONE;
-                        lock.unlock();
 
-                        if (m_threadq->m_qlen > 0) {
+                        // the eventfd or the pipe stays registered, and a
+                        // notification which has been written is drained
+                        // by select_fd()
+                        if (m_threadq->is_ready())
                             m_running->m_is_ev_thq = true;
-                            uint8_t buf[32];
-                            while (read(m_threadq->m_qpipe[0], buf, sizeof(buf)) > 0);
-                        }
-#ifdef KQUEUE
-                        struct kevent kev;
-                        EV_SET(&kev, m_threadq->m_qpipe[0], EVFILT_READ, EV_DELETE, 0, 0, nullptr);
-                        for (;;) {
-                            if (kevent(m_kq, &kev, 1, nullptr, 0, nullptr) == -1) {
-                                if (errno == EINTR) continue;
-                                PRINTERR("failed kevent!: %s", strerror(errno));
-                                exit(-1);
-                            } else {
-                                break;
-                            }
-                        }
-#elif (defined EPOLL)
-                        for (;;) {
-                            if (epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_threadq->m_qpipe[0], nullptr) < -1) {
-                                if (errno == EINTR) continue;
-                                PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                                exit(-1);
-                            } else {
-                                break;
-                            }
-                        }
-#endif // KQUEUE
-                    } else {
-                        lock.unlock();
                     }
 
                     m_wait_thq = nullptr;
                 }
 
+                resume_stats();
+
                 if (ctx == m_running)
                     return;
 
-                if (sigsetjmp(ctx->m_jmp_buf, 0) == 0) {
-                    siglongjmp(m_running->m_jmp_buf, 1);
-                } else {
-                    if (! m_stop.empty())
-                        remove_stopped();
+                lunar_swap_context(ctx ? &ctx->m_sp : &m_sp, m_running->m_sp);
 
-                    return;
-                }
+                // this context may be resumed by another scheduler
+                auto gt = get_lunar_gt();
+                if (! gt->m_stop.empty())
+                    gt->remove_stopped();
+
+                return;
             }
         }
 
         if (m_wait_thq) {
-            spin_lock_acquire_unsafe lock(m_threadq->m_qlock);
-            if (m_threadq->m_qlen > 0) {
-                lock.unlock();
+            // avoid the condition wait and the notification by producers
+            // if data will arrive soon
+            if (! is_waiting_fd() && m_timeout.empty())
+                idle_threadq();
+
+            bool is_cond = ! is_waiting_fd() && m_timeout.empty();
 
+            if (! m_threadq->prepare_wait(is_cond ? threadq::QWAIT_COND : threadq::QWAIT_PIPE)) {
                 if (! (m_wait_thq->m_state & context::SUSPENDING)) {
                     m_wait_thq->m_state |= context::SUSPENDING;
                     m_suspend.push_back(m_wait_thq);
+                    TRACE_GT(TRACE_WAKE, m_wait_thq->m_id, TRACE_THQ);
                 }
 
                 m_wait_thq->m_is_ev_thq = true;
                 m_wait_thq = nullptr;
                 continue;
-            } else {
-                m_threadq->m_is_qnotified = false;
-                if (m_wait_fd.empty() && m_timeout.empty()) {
-                    m_threadq->m_qwait_type = threadq::QWAIT_COND;
-                    lock.unlock();
-                    // wait the notification via condition wait
-                    {
-                        std::unique_lock<std::mutex> mlock(m_threadq->m_qmutex);
-                        if (m_threadq->m_qlen == 0)
+            } else if (is_cond) {
+#ifdef __linux__
+                m_stack_pool.trim();
+#endif // __linux__
+                // wait the notification via condition wait
+                {
+                    std::unique_lock<std::mutex> mlock(m_threadq->m_qmutex);
+                    if (! m_threadq->is_ready() && ! m_is_posted) {
+                        m_stats.num_idle_parks++;
+                        arm_preemption(false);
+                        if (is_polling())
+                            m_threadq->m_qcond.wait_for(mlock, std::chrono::milliseconds(STEAL_INTERVAL));
+                        else
                             m_threadq->m_qcond.wait(mlock);
-
-                        m_threadq->m_qwait_type = threadq::QWAIT_NONE;
+                        arm_preemption(true);
                     }
 
-                    if (! (m_wait_thq->m_state & context::SUSPENDING)) {
-                        m_wait_thq->m_state |= context::SUSPENDING;
-                        m_suspend.push_back(m_wait_thq);
-                    }
+                    m_threadq->m_qwait_type = threadq::QWAIT_NONE;
+                }
 
-                    m_wait_thq->m_is_ev_thq = true;
-                    m_wait_thq = nullptr;
+                // woken by notify_post() or the interval
+                if (! m_threadq->is_ready()) {
+                    if (m_is_steal && ! m_is_posted)
+                        steal();
                     continue;
-                } else {
-                    // wait the notificication via pipe
-                    m_threadq->m_qwait_type = threadq::QWAIT_PIPE;
-                    lock.unlock();
+                }
 
-#ifdef KQUEUE
-                    struct kevent kev;
-                    EV_SET(&kev, m_threadq->m_qpipe[0], EVFILT_READ, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0, NULL);
-                    for (;;) {
-                        if (kevent(m_kq, &kev, 1, nullptr, 0, nullptr) == -1) {
-                            if (errno == EINTR) continue;
-                            PRINTERR("failed kevent!: %s", strerror(errno));
-                            exit(-1);
-                        } else {
-                            break;
-                        }
-                    }
-#elif (defined EPOLL)
-                    epoll_event eev;
-                    eev.data.fd = m_threadq->m_qpipe[0];
-                    eev.events  = EPOLLIN;
-                    for (;;) {
-                        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_threadq->m_qpipe[0], &eev) < -1) {
-                            if (errno == EINTR) continue;
-                            PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                            exit(-1);
-                        } else {
-                            break;
-                        }
-                    }
-#endif // KQUEUE
+                if (! (m_wait_thq->m_state & context::SUSPENDING)) {
+                    m_wait_thq->m_state |= context::SUSPENDING;
+                    m_suspend.push_back(m_wait_thq);
+                    TRACE_GT(TRACE_WAKE, m_wait_thq->m_id, TRACE_THQ);
                 }
+
+                m_wait_thq->m_is_ev_thq = true;
+                m_wait_thq = nullptr;
+                continue;
             }
-        } else if (m_wait_fd.empty() && m_timeout.empty()) {
-            break;
+
+            // wait the notification via pipe or eventfd by select_fd()
+        } else if (! is_waiting_fd() && m_timeout.empty()) {
+            if (m_is_steal && adopt_stolen())
+                continue;
+
+            // wait posts of spawn_on(), lunar_runtime_shutdown(), or the
+            // other schedulers waking contexts of this
+            if (! m_is_resident && ! is_waiting_post())
+                break;
+
+            {
+                std::unique_lock<std::mutex> mlock(m_threadq->m_qmutex);
+                if (! m_is_posted) {
+                    arm_preemption(false);
+                    if (m_is_steal)
+                        m_threadq->m_qcond.wait_for(mlock, std::chrono::milliseconds(STEAL_INTERVAL));
+                    else
+                        m_threadq->m_qcond.wait(mlock);
+                    arm_preemption(true);
+                }
+            }
+
+            if (m_is_steal && ! m_is_posted)
+                steal();
+
+            continue;
         }
 
+#ifdef __linux__
+        m_stack_pool.trim();
+#endif // __linux__
+
+        arm_preemption(false);
+
         for (;;) {
+            uint64_t t0 = get_monotonic_ns();
             select_fd(true);
+            m_stats.select_fd_block_ns += get_monotonic_ns() - t0;
+
             if (! m_timeout.empty())
                 resume_timeout();
-            if (! m_suspend.empty())
+            if (! m_suspend.empty() || m_is_posted)
+                break;
+            if (m_is_steal && steal())
                 break;
         }
+
+        arm_preemption(true);
     }
 
-    siglongjmp(m_jmp_buf, 1);
+    // still on the scheduler's stack
+    if (m_running == nullptr)
+        return;
+
+    // return to run()
+    uint64_t *sp;
+    lunar_swap_context(&sp, m_sp);
 }
 
 #if (defined KQUEUE)
 void
 green_thread::select_stream(struct kevent *kev, int num_kev,
                      void * const *stream, int num_stream,
-                     bool is_threadq, int64_t timeout)
+                     bool is_threadq, int64_t timeout,
+                     void * const *join, int num_join)
 #elif (defined EPOLL) // #if (defined KQUEUE)
 void
 green_thread::select_stream(epoll_event *eev, int num_eev,
                      void * const *stream, int num_stream,
-                     bool is_threadq, int64_t timeout)
+                     bool is_threadq, int64_t timeout,
+                     void * const *join, int num_join)
 #endif // #if (defined KQUEUE)
 {
     m_running->m_state = 0;
     m_running->m_events.clear();
     m_running->m_ev_stream.clear();
+    m_running->m_ev_join.clear();
     m_running->m_is_ev_thq = false;
     m_running->m_is_ev_timeout = false;
 
+    // cancelled contexts only yield
+    if (m_running->m_is_cancelled) {
+        m_running->m_state = context::SUSPENDING;
+        m_suspend.push_back(m_running);
+        schedule();
+        return;
+    }
+
     if (timeout) {
         m_running->m_state |= context::WAITING_TIMEOUT;
-        m_timeout.insert(ctx_time(lunar_clock + (uint64_t)timeout, m_running));
+        m_timeout.insert(&m_running->m_timer, get_clock_us() + (uint64_t)timeout);
     }
 
 #ifdef KQUEUE
@@ -1120,40 +2094,15 @@ green_thread::select_stream(epoll_event *eev, int num_eev,
     if (num_eev > 0) {
         m_running->m_state |= context::WAITING_FD;
         for (int i = 0; i < num_eev; i++) {
-            auto it_in  = m_wait_fd.find({eev[i].data.fd, EPOLLIN});
-            auto it_out = m_wait_fd.find({eev[i].data.fd, EPOLLOUT});
-
-            if (it_in == m_wait_fd.end() && it_out == m_wait_fd.end()) {
-                for (;;) {
-                    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, eev[i].data.fd, &eev[i]) < 0) {
-                        if (errno == EINTR) continue;
-                        PRINTERR("failed epoll_ctl!: %s", strerror(errno));
-                        exit(-1);
-                    } else {
-                        break;
-                    }
-                }
-            } else if ((it_out != m_wait_fd.end() && eev[i].events == EPOLLIN) ||
-                       (it_in != m_wait_fd.end() && eev[i].events == EPOLLOUT)) {
-                epoll_event e = eev[i];
-                e.events = EPOLLIN | EPOLLOUT;
-                for (;;) {
-                    if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, e.data.fd, &e) < -1) {
-                        if (errno == EINTR) continue;
-                        PRINTERR("failed epoll_ctl: %s", strerror(errno));
-                        exit(-1);
-                    }
-                }
-            }
+            int fd = eev[i].data.fd;
 
-            auto it = m_wait_fd.find({eev[i].data.fd, eev[i].events});
-            if (it == m_wait_fd.end()) {
-                m_wait_fd.insert({{eev[i].data.fd, eev[i].events}, std::unordered_set<context*>()});
-                m_wait_fd.find({eev[i].data.fd, eev[i].events})->second.insert(m_running);
-            } else {
-                it->second.insert(m_running);
-            }
-            m_running->m_fd.push_back({eev[i].data.fd, eev[i].events});
+            register_fd(fd, eev[i].events);
+
+            if (eev[i].events & EPOLLIN)
+                wait_fd(fd, EPOLLIN, FD_READY_IN);
+
+            if (eev[i].events & EPOLLOUT)
+                wait_fd(fd, EPOLLOUT, FD_READY_OUT);
         }
     }
 #endif // KQUEUE
@@ -1174,6 +2123,42 @@ green_thread::select_stream(epoll_event *eev, int num_eev,
         m_wait_thq->m_state |= context::WAITING_THQ;
     }
 
+    if (num_join) {
+        for (int i = 0; i < num_join; i++) {
+            auto h = (join_handle*)join[i];
+
+            spin_lock_acquire lock(h->m_lock);
+            if (h->m_is_done) {
+                m_running->m_ev_join.push_back(h);
+                continue;
+            }
+
+            assert(h->m_waiter == nullptr);
+            h->m_waiter    = m_running;
+            h->m_waiter_gt = this;
+            m_running->m_wait_join.push_back(h);
+
+            if (h->m_gt != this)
+                m_running->m_is_remote_join = true;
+        }
+
+        if (! m_running->m_wait_join.empty()) {
+            m_running->m_state |= context::WAITING_JOIN;
+            m_num_wait_join++;
+            if (m_running->m_is_remote_join)
+                m_num_remote_join++;
+        }
+
+    }
+
+    // do not wait if some file descriptors are ready or some green threads
+    // have been stopped
+    if ((! m_running->m_events.empty() || ! m_running->m_ev_join.empty()) &&
+        m_running->m_state != 0) {
+        m_running->m_state |= context::SUSPENDING;
+        m_suspend.push_back(m_running);
+    }
+
     if (m_running->m_state == 0) {
         m_running->m_state = context::SUSPENDING;
         m_suspend.push_back(m_running);
@@ -1182,36 +2167,550 @@ green_thread::select_stream(epoll_event *eev, int num_eev,
     schedule();
 }
 
+#ifdef EPOLL
+// FD_REGISTERED may be stale, because the file descriptor may have been
+// closed by another scheduler or thread and reused after that, so that
+// the registration is checked by EPOLL_CTL_ADD unless the wait is
+// satisfied by the cached readiness
 void
-green_thread::remove_stopped()
+green_thread::register_fd(int fd, uint32_t events)
+{
+    if ((size_t)fd >= m_fd_flags.size())
+        m_fd_flags.resize(fd + 1, 0);
+
+    if (((events & EPOLLIN) && (m_fd_flags[fd] & FD_READY_IN)) ||
+        ((events & EPOLLOUT) && (m_fd_flags[fd] & FD_READY_OUT)))
+        return;
+
+    epoll_event eev;
+    eev.data.fd = fd;
+    eev.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+    for (;;) {
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &eev) == -1) {
+            if (errno == EINTR) continue;
+
+            if (errno == EEXIST) {
+                m_fd_flags[fd] |= FD_REGISTERED;
+                return;
+            }
+
+            PRINTERR("failed epoll_ctl!: %s", strerror(errno));
+            exit(-1);
+        } else {
+            break;
+        }
+    }
+
+    // a new file. the readiness cached for the old file is dropped, and
+    // the first epoll_wait() reports the readiness of the new file
+    m_fd_flags[fd] = FD_REGISTERED;
+}
+
+// consume the cached readiness, or wait the next edge
+void
+green_thread::wait_fd(int fd, uint32_t event, uint8_t ready)
+{
+    if (m_fd_flags[fd] & ready) {
+        m_fd_flags[fd] &= ~ready;
+        m_running->m_events.push_back({fd, event, 0, 0, 0});
+        return;
+    }
+
+    auto it = m_wait_fd.find({fd, event});
+    if (it == m_wait_fd.end()) {
+        m_wait_fd.insert({{fd, event}, std::unordered_set<context*>()});
+        m_wait_fd.find({fd, event})->second.insert(m_running);
+    } else {
+        it->second.insert(m_running);
+    }
+
+    m_running->m_fd.push_back({fd, event});
+}
+
+// deliver the readiness to the waiters, or cache it
+void
+green_thread::wake_fd(int fd, uint32_t event, uint8_t ready)
+{
+    auto it = m_wait_fd.find({fd, event});
+    if (it == m_wait_fd.end()) {
+        m_fd_flags[fd] |= ready;
+        return;
+    }
+
+    for (auto ctx: it->second) {
+        if (! (ctx->m_state & context::SUSPENDING)) {
+            ctx->m_state |= context::SUSPENDING;
+            m_suspend.push_back(ctx);
+            TRACE_GT(TRACE_WAKE, ctx->m_id, TRACE_FD);
+        }
+        ctx->m_events.push_back({fd, event, 0, 0, 0});
+    }
+
+    m_wait_fd.erase(it);
+}
+#endif // EPOLL
+
+int
+green_thread::close_fd(int fd)
+{
+#ifdef EPOLL
+    if (fd >= 0 && (size_t)fd < m_fd_flags.size() && (m_fd_flags[fd] & FD_REGISTERED)) {
+        // the registration remains while the file is shared by dup() or fork()
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+
+        // waiters will see the closed file descriptor
+        wake_fd(fd, EPOLLIN, FD_READY_IN);
+        wake_fd(fd, EPOLLOUT, FD_READY_OUT);
+
+        m_fd_flags[fd] = 0;
+    }
+#endif // EPOLL
+
+    return close(fd);
+}
+
+int64_t
+green_thread::insert_context(context *ctx)
+{
+    if (m_is_accounting) {
+        spin_lock_acquire lock(m_stats_lock);
+        return m_id2context.insert(ctx);
+    }
+
+    return m_id2context.insert(ctx);
+}
+
+void
+green_thread::erase_context(int64_t id)
+{
+    if (m_is_accounting) {
+        spin_lock_acquire lock(m_stats_lock);
+        m_id2context.erase(id);
+        return;
+    }
+
+    m_id2context.erase(id);
+}
+
+bool
+green_thread::idle_threadq()
+{
+    if ((m_idle_spin_ns == 0 && m_idle_yield_ns == 0) || m_threadq->is_ready())
+        return m_threadq->is_ready();
+
+    uint64_t start = get_monotonic_ns();
+    uint64_t now   = start;
+
+    // m_is_qnotified is left as it is, so producers do not notify while
+    // this scheduler is spinning
+    while (now - start < m_idle_spin_ns) {
+        for (int i = 0; i < 64; i++) {
+            if (m_threadq->is_ready()) {
+                m_stats.num_idle_spins++;
+                return true;
+            }
+            _MM_PAUSE;
+        }
+
+        if (m_is_posted || m_steal_req)
+            return false;
+
+        now = get_monotonic_ns();
+    }
+
+    start = now;
+    while (now - start < m_idle_yield_ns) {
+        sched_yield();
+
+        if (m_threadq->is_ready()) {
+            m_stats.num_idle_yields++;
+            return true;
+        }
+
+        if (m_is_posted || m_steal_req)
+            return false;
+
+        now = get_monotonic_ns();
+    }
+
+    return false;
+}
+
+#ifdef LUNAR_TRACE
+uint32_t
+green_thread::trace_reason(uint32_t state)
+{
+    uint32_t reason = 0;
+
+    if (state & context::WAITING_FD)
+        reason |= TRACE_FD;
+    if (state & context::WAITING_STREAM)
+        reason |= TRACE_STREAM;
+    if (state & context::WAITING_THQ)
+        reason |= TRACE_THQ;
+    if (state & context::WAITING_TIMEOUT)
+        reason |= TRACE_TIMEOUT;
+    if (state & context::WAITING_JOIN)
+        reason |= TRACE_JOIN;
+    if (state & context::WAITING_SYNC)
+        reason |= TRACE_SYNC;
+    if (state & context::WAITING_IO)
+        reason |= TRACE_IO;
+
+    return reason;
+}
+#endif // LUNAR_TRACE
+
+void
+green_thread::resume_stats()
+{
+    m_stats.num_switches++;
+    m_stats.len_run_queue = m_suspend.size();
+    m_is_preempt = false;
+    TRACE_GT(TRACE_RESUME, m_running->m_id, 0);
+
+    if (m_is_accounting) {
+        m_running->m_num_resumes++;
+        m_resume_tsc = rdtsc();
+    }
+}
+
+#ifdef __linux__
+static void
+preempt_handler(int, siginfo_t*, void*)
+{
+    if (lunar_gt)
+        lunar_gt->tick_preemption();
+}
+#endif // __linux__
+
+bool
+green_thread::enable_preemption(uint64_t slice_us)
 {
-    for (auto ctx: m_stop) {
 #ifdef __linux__
-        if (mprotect(&ctx->m_stack[0], m_pagesize, PROT_READ | PROT_WRITE) < 0) {
-            PRINTERR("failed mprotect!: %s", strerror(errno));
+    if (m_is_preempt_timer || slice_us == 0)
+        return false;
+
+    // install the handler only once for all schedulers
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = preempt_handler;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(GT_PREEMPT_SIGNAL, &sa, nullptr) == -1) {
+            PRINTERR("failed sigaction!: %s", strerror(errno));
             exit(-1);
         }
-        free(ctx->m_stack);
+    });
+
+    // deliver the signal to this thread
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo  = GT_PREEMPT_SIGNAL;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+
+    if (timer_create(CLOCK_MONOTONIC, &sev, &m_preempt_timer) == -1) {
+        PRINTERR("failed timer_create!: %s", strerror(errno));
+        return false;
+    }
+
+    auto &its = m_preempt_slice;
+    its.it_value.tv_sec     = slice_us / 1000000;
+    its.it_value.tv_nsec    = (slice_us % 1000000) * 1000;
+    its.it_interval = its.it_value;
+
+    if (timer_settime(m_preempt_timer, 0, &its, nullptr) == -1) {
+        PRINTERR("failed timer_settime!: %s", strerror(errno));
+        timer_delete(m_preempt_timer);
+        return false;
+    }
+
+    m_is_preempt_timer = true;
+
+    return true;
+#else
+    return false;
+#endif // __linux__
+}
+
+// called around sleeps of the scheduler
+void
+green_thread::arm_preemption(bool is_arm)
+{
+#ifdef __linux__
+    if (! m_is_preempt_timer)
+        return;
+
+    struct itimerspec zero;
+    memset(&zero, 0, sizeof(zero));
+
+    if (timer_settime(m_preempt_timer, 0, is_arm ? &m_preempt_slice : &zero, nullptr) == -1) {
+        PRINTERR("failed timer_settime!: %s", strerror(errno));
+        exit(-1);
+    }
+#endif // __linux__
+}
+
+// async-signal-safe: only reads and writes the members of this scheduler
+void
+green_thread::tick_preemption()
+{
+    uint64_t seq = m_stats.num_switches;
+
+    if (seq == m_preempt_seq)
+        m_is_preempt = true;
+    else
+        m_preempt_seq = seq;
+}
+
+void
+green_thread::yield_preempted()
+{
+    m_is_preempt = false;
+    m_stats.num_preemptions++;
+
+    // m_running is RUNNING, so it is pushed back to the run queue
+    schedule();
+}
+
+void
+green_thread::get_stats(stats_green_thread *stats)
+{
+    *stats = m_stats;
+    stats->num_contexts = m_id2context.size();
+}
+
+ssize_t
+green_thread::get_context_stats(context_stats_green_thread *stats, size_t len)
+{
+    if (! m_is_accounting)
+        return -1;
+
+    size_t n = 0;
+
+    spin_lock_acquire lock(m_stats_lock);
+    m_id2context.for_each([&](context *ctx) {
+        if (n == len)
+            return;
+
+        stats[n].id          = ctx->m_id;
+        stats[n].state       = ctx->m_state;
+        stats[n].num_resumes = ctx->m_num_resumes;
+        stats[n].run_cycles  = ctx->m_run_cycles;
+        n++;
+    });
+
+    return n;
+}
+
+void
+green_thread::remove_stopped()
+{
+    for (auto ctx: m_stop) {
+        for (int i = 0; i < GT_GLS_KEYS; i++) {
+            if (ctx->m_gls[i] && gls_destructor[i])
+                gls_destructor[i](ctx->m_gls[i]);
+        }
+
+#ifdef __linux__
+        m_stack_pool.deallocate(ctx->m_stack, ctx->m_stack_size * sizeof(uint64_t));
 #else
         m_slub_stack.deallocate(ctx->m_stack);
 #endif // __linux__
-        m_id2context.erase(ctx->m_id);
+        erase_context(ctx->m_id);
+
+        if (m_free_context.size() < MAX_FREE_CONTEXT) {
+            ctx->m_fd.clear();
+            ctx->m_stream.clear();
+            ctx->m_ev_stream.clear();
+            ctx->m_events.clear();
+            ctx->m_ev_join.clear();
+            m_free_context.push_back(ctx);
+        } else {
+            delete ctx;
+        }
     }
 
     m_stop.clear();
 }
 
+bool
+green_thread::steal()
+{
+    if (adopt_stolen())
+        return true;
+
+    uint64_t tag = thread_id + 1;
+
+    rtm_transaction tr(lock_thread2gt);
+
+    // withdraw the request which has not been handled by the victim
+    if (m_steal_victim) {
+        auto it = thread2gt.find(m_steal_victim - 1);
+        if (it != thread2gt.end())
+            __sync_bool_compare_and_swap(&it->second->m_steal_req, tag, 0);
+
+        m_steal_victim = 0;
+    }
+
+    if (thread2gt.size() < 2)
+        return false;
+
+    auto it = thread2gt.begin();
+    for (uint64_t i = m_steal_idx++ % thread2gt.size(); i > 0; i--)
+        ++it;
+
+    for (size_t i = 0; i < thread2gt.size(); i++, ++it) {
+        if (it == thread2gt.end())
+            it = thread2gt.begin();
+
+        if (it->second == this || ! it->second->m_is_steal)
+            continue;
+
+        if (__sync_bool_compare_and_swap(&it->second->m_steal_req, 0, tag)) {
+            m_steal_victim = it->first + 1;
+            break;
+        }
+    }
+
+    return false;
+}
+
+bool
+green_thread::adopt_stolen()
+{
+    std::vector<context*> stolen;
+
+    {
+        spin_lock_acquire lock(m_steal_lock);
+        if (m_stolen.empty())
+            return false;
+
+        stolen.swap(m_stolen);
+    }
+
+    for (auto ctx: stolen) {
+        ctx->m_id = insert_context(ctx);
+
+        if (ctx->m_join) {
+            spin_lock_acquire lock(ctx->m_join->m_lock);
+            ctx->m_join->m_gt = this;
+        }
+        m_suspend.push_back(ctx);
+        TRACE_GT(TRACE_SPAWN, ctx->m_id, 1);
+    }
+
+    return true;
+}
+
+bool
+green_thread::is_donatable(context *ctx)
+{
+    if (ctx->m_state != context::READY && ctx->m_state != context::SUSPENDING)
+        return false;
+
+#ifdef __linux__
+    // stacks in the regions of m_stack_pool are unmapped with this scheduler
+    return ! m_stack_pool.is_reserved(ctx->m_stack, ctx->m_stack_size * sizeof(uint64_t));
+#else
+    return true;
+#endif // __linux__
+}
+
+void
+green_thread::donate(context *running)
+{
+    uint64_t req = m_steal_req;
+
+    int n = 0;
+    for (auto c: m_suspend) {
+        if (c != running && is_donatable(c))
+            n++;
+    }
+
+    n /= 2;
+
+    if (n == 0) {
+        __sync_bool_compare_and_swap(&m_steal_req, req, 0);
+        return;
+    }
+
+    // take contexts from the tail of the run queue
+    std::vector<context*> donation;
+    std::vector<int64_t>  ids;
+    std::deque<context*> rest;
+    for (auto it = m_suspend.rbegin(); it != m_suspend.rend(); ++it) {
+        auto c = *it;
+        if (n > 0 && c != running && is_donatable(c)) {
+            donation.push_back(c);
+            ids.push_back(c->m_id);
+            n--;
+        } else {
+            rest.push_front(c);
+        }
+    }
+
+    bool is_donated = false;
+
+    {
+        rtm_transaction tr(lock_thread2gt);
+        if (__sync_bool_compare_and_swap(&m_steal_req, req, 0)) {
+            auto it = thread2gt.find(req - 1);
+            if (it != thread2gt.end() && it->second->m_is_steal) {
+                spin_lock_acquire lock(it->second->m_steal_lock);
+                it->second->m_stolen.insert(it->second->m_stolen.end(),
+                                            donation.begin(), donation.end());
+                is_donated = true;
+            }
+        }
+    }
+
+    if (! is_donated)
+        return;
+
+    // the donated contexts may be already running on the other scheduler
+    m_suspend.swap(rest);
+
+    for (auto id: ids)
+        erase_context(id);
+}
+
 green_thread::threadq::threadq(int qsize, int vecsize)
-    : m_qlen(0),
+    : m_qtail(0),
+      m_qhead(0),
       m_is_qnotified(true),
       m_qwait_type(threadq::QWAIT_NONE),
-      m_max_qlen(qsize),
-      m_q(new char[qsize * vecsize]),
-      m_qend(m_q + qsize * vecsize),
-      m_qhead(m_q),
-      m_qtail(m_q),
+      m_qsize(2),
+      m_vecsize(vecsize),
+      m_slot_size((sizeof(uint64_t) + vecsize + 7) & ~(size_t)7),
       m_is_closed(false)
 {
+    // the capacity is rounded up to a power of 2, and is 2 at least,
+    // so that sequence numbers of used and free slots are not confused
+    while (m_qsize < (uint64_t)qsize)
+        m_qsize <<= 1;
+
+    m_qmask = m_qsize - 1;
+    m_q     = new char[m_qsize * m_slot_size];
+
+    // touch the buffer on this thread, so that it is placed on the NUMA
+    // node of the consumer rather than of the first producer
+    memset(m_q, 0, m_qsize * m_slot_size);
+
+    for (uint64_t i = 0; i < m_qsize; i++)
+        *(uint64_t*)(m_q + i * m_slot_size) = i;
+
+#ifdef EPOLL
+    m_qevent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_qevent == -1) {
+        PRINTERR("could not create eventfd!: %s", strerror(errno));
+        exit(-1);
+    }
+#else
     if (pipe(m_qpipe) == -1) {
         PRINTERR("could not create pipe!: %s", strerror(errno));
         exit(-1);
@@ -1219,12 +2718,24 @@ green_thread::threadq::threadq(int qsize, int vecsize)
 
     int val = 1;
     ioctl(m_qpipe[0], FIONBIO, &val);
+#endif // EPOLL
 }
 
 green_thread::threadq::~threadq()
 {
     delete[] m_q;
 
+#ifdef EPOLL
+    for (;;) {
+        if (close(m_qevent) < 0) {
+            if (errno == EINTR) continue;
+            PRINTERR("failed close!: %s", strerror(errno));
+            exit(-1);
+        } else {
+            break;
+        }
+    }
+#else
     for (;;) {
         if (close(m_qpipe[0]) < 0) {
             if (errno == EINTR) continue;
@@ -1244,6 +2755,7 @@ green_thread::threadq::~threadq()
             break;
         }
     }
+#endif // EPOLL
 }
 
 }
@@ -7,9 +7,14 @@
 #include "lunar_ringq.hpp"
 #include "lunar_shared_type.hpp"
 #include "lunar_slab_allocator.hpp"
+#include "lunar_timer_wheel.hpp"
+#include "lunar_slot_table.hpp"
+#include "lunar_trace.hpp"
+#include "lunar_uring.hpp"
 
 #ifdef __linux__
 #include "hopscotch.hpp"
+#include "lunar_stack_pool.hpp"
 #endif // __linux__
 
 #ifndef __linux__
@@ -17,7 +22,6 @@
 #endif // __linux__
 
 #include <unistd.h>
-#include <setjmp.h>
 
 #include <string>
 #include <vector>
@@ -28,11 +32,6 @@
 #include <mutex>
 #include <condition_variable>
 
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/member.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/hashed_index.hpp>
-
 #if (defined(__unix__) || defined(unix) || (defined __APPLE__)) && !defined(USG)
 #include <sys/param.h>
 #endif
@@ -52,6 +51,9 @@
 #elif (defined EPOLL)
 #include <sys/epoll.h>
 #endif // KQUEUE
+
+#include <signal.h>
+#include <time.h>
 /*
 #define TIMESPECCMP(tvp, uvp, cmp)                  \
     (((tvp)->tv_sec == (uvp)->tv_sec) ?             \
@@ -87,9 +89,9 @@
         (ts)->tv_nsec = tv.tv_usec * 1000;          \
     } while (0)
 #elif (defined BSD)
-#define GETTIME(ts) clock_gettime(CLOCK_MONOTONIC_FAST, ts)
+#define GETTIME(ts) clock_gettime(CLOCK_MONOTONIC, ts)
 #elif (defined __linux__)
-#define GETTIME(ts) clock_gettime(CLOCK_MONOTONIC_COARSE, ts)
+#define GETTIME(ts) clock_gettime(CLOCK_MONOTONIC, ts) // served by vDSO
 #endif // __APPLE__
 
 #ifdef KQUEUE
@@ -155,33 +157,209 @@
     #define FD_EV_FFLAG_TRAC       0x2000
 #endif // EPOLL
 
+// stack size classes for spawn_green_thread_ex
+#define GT_STACK_16K  (16 * 1024)
+#define GT_STACK_64K  (64 * 1024)
+#define GT_STACK_256K (256 * 1024)
+#define GT_STACK_4M   (4 * 1024 * 1024)
+
+// signal for preemption, which is ignored by default
+#define GT_PREEMPT_SIGNAL SIGURG
+
+// maximum number of keys of green thread local storage
+#define GT_GLS_KEYS 16
+
+// flags for spawn_green_thread_ex
+#define GT_STACK_EXACT 0x0001 // do not round the stack size up to a size class
+
+// flags for init_green_thread_ex
+#define GT_BACKEND_URING 0x0001 // use io_uring if available (Linux only)
+
 namespace lunar {
 
 class green_thread;
 
+// an entry of wait queues of gt_mutex, gt_cond and gt_semaphore, which is
+// placed on the stack of the waiting green thread.
+// m_is_queued is protected by the lock of the wait queue, and
+// m_is_signaled is written only by m_gt
+struct gt_waiter {
+    void         *m_ctx;
+    green_thread *m_gt;
+    gt_waiter    *m_prev;
+    gt_waiter    *m_next;
+    bool          m_is_queued;
+    bool          m_is_signaled;
+
+    gt_waiter() : m_ctx(nullptr), m_gt(nullptr), m_prev(nullptr), m_next(nullptr),
+                  m_is_queued(false), m_is_signaled(false) { }
+};
+
 extern "C" {
-    uint64_t get_clock();
+    uint64_t get_clock();    // milliseconds
+    uint64_t get_clock_ns(); // nanoseconds
     bool init_green_thread(uint64_t thid, int qlen, int vecsize); // thid is user defined thread ID
+
+    // io_uring backend (Linux 5.11 or later)
+    // with GT_BACKEND_URING, the scheduler owns an io_uring, which waits
+    // for the epoll descriptor of select_green_thread and completions of
+    // gt_read, gt_write, gt_accept and gt_connect (see lunar_gt_io.hpp).
+    // if io_uring is not available, the scheduler falls back to epoll,
+    // and is_uring_green_thread returns false
+    bool init_green_thread_ex(uint64_t thid, int qlen, int vecsize, uint32_t flags);
+    bool is_uring_green_thread();
+
+    // CPU affinity and NUMA placement (Linux only)
+    // init_green_thread_on_cpu pins the calling OS thread to cpu before
+    // init_green_thread, so that the thread queue, stacks and slab pages
+    // are allocated on the local NUMA node by the first-touch policy.
+    // get_cpu_green_thread and get_numa_node_green_thread return -1 if
+    // the scheduler is not found or not pinned, and
+    // get_nearby_threads_green_thread stores the IDs of the other pinned
+    // schedulers on the same NUMA node as thid, and returns their number
+    bool    init_green_thread_on_cpu(uint64_t thid, int qlen, int vecsize, int cpu);
+    int     get_cpu_green_thread(uint64_t thid);
+    int     get_numa_node_green_thread(uint64_t thid);
+    ssize_t get_nearby_threads_green_thread(uint64_t thid, uint64_t *thids, size_t len);
+
+    // runtime
+    // lunar_runtime_start starts nthreads OS threads running schedulers
+    // whose thread IDs are [thid_base, thid_base + nthreads), and returns
+    // after all of them are ready. the schedulers keep running without
+    // green threads until lunar_runtime_shutdown, which waits for all
+    // green threads to return and joins the OS threads.
+    // spawn_on can be called by any thread for the schedulers of the
+    // runtime, and by a green thread for its own scheduler.
+    // green threads of spawn_on have 4 MiB stacks as spawn_green_thread.
+    // zero fields of the options (or nullptr) mean the defaults
+    struct lunar_runtime_options {
+        int         qlen;      // length of the thread queues (1024)
+        int         vecsize;   // bytes of an element of the thread queues (sizeof(void*))
+        uint64_t    thid_base; // (0)
+        const int  *cpus;      // CPUs to pin the schedulers (not pinned)
+        bool        is_steal;  // enable work stealing (false)
+    };
+
+    bool lunar_runtime_start(int nthreads, const lunar_runtime_options *options);
+    bool spawn_on(uint64_t thid, void (*func)(void*), void *arg);
+    void lunar_runtime_shutdown();
     void schedule_green_thread();
     void spawn_green_thread(void (*func)(void*), void *arg = nullptr);
+    int64_t spawn_green_thread_ex(void (*func)(void*), void *arg, size_t stack_size, uint32_t flags);
     void run_green_thread();
+    bool enable_steal_green_thread();
+    void set_stack_cache_green_thread(size_t bytes); // high-water mark of cached stacks
+    bool reserve_stack_green_thread(size_t num_stacks, bool is_guard);
+    bool enable_accounting_green_thread(); // must be called before run_green_thread
+
+    // preemption (Linux only)
+    // a timer signal (GT_PREEMPT_SIGNAL) marks the running green thread
+    // which has run for a time slice (slice_us microseconds), and the
+    // green thread yields at the next preemption point, that is
+    // preempt_point_green_thread() or functions for streams and
+    // the thread queue. must be called before run_green_thread
+    bool enable_preemption_green_thread(uint64_t slice_us);
+    void preempt_point_green_thread();
+
+    // idle policy for the thread queue
+    // when only the thread queue is waited on, an idle scheduler polls it
+    // for spin_us microseconds, then calls sched_yield() for yield_us
+    // microseconds, and then sleeps on the condition variable.
+    // both are 0 (park immediately) by default
+    void set_idle_policy_green_thread(uint64_t spin_us, uint64_t yield_us);
+
+    // the maximum number of events returned by a call of epoll_wait() or
+    // kevent() (256 by default)
+    void set_max_events_green_thread(int max_events);
+
+    // green thread local storage
+    // a key is allocated by gls_create_key_green_thread once for the
+    // process, which returns -1 if GT_GLS_KEYS keys have been allocated.
+    // a value of each key is stored in the running green thread, and is
+    // nullptr initially. when a green thread returns, the destructor of
+    // a key is called for the non-null value by the scheduler, so that it
+    // must not block or use green thread local storage
+    int   gls_create_key_green_thread(void (*destructor)(void*));
+    void* gls_get_green_thread(int key);
+    void  gls_set_green_thread(int key, void *value);
+
+    // tracing (see lunar_trace.hpp)
+    // return false if LUNAR_TRACE is not defined
+    bool flush_trace_green_thread(const char *path);
+
+    // join handles
+    // a handle returned by spawn_joinable_green_thread must be released
+    // by join_green_thread, which returns true, or detach_green_thread.
+    // timeout is milliseconds, and 0 means infinity
+    void* spawn_joinable_green_thread(void *(*func)(void*), void *arg, size_t stack_size, uint32_t flags);
+    bool  join_green_thread(void *handle, int64_t timeout, void **result);
+    void  detach_green_thread(void *handle);
+
+    // cancellation
+    // a cancelled green thread is resumed from select_green_thread,
+    // join_green_thread and the waits of gt_cond and gt_semaphore, which
+    // never block after that, and is expected to return from its function.
+    // id is returned by spawn_green_thread_ex on the same scheduler, and
+    // changes when the green thread is stolen by another scheduler
+    bool cancel_green_thread(int64_t id);
+    bool is_cancelled_green_thread();
     uint64_t get_thread_id();
     void* get_green_thread(uint64_t thid);
     bool is_timeout_green_thread();
 
+    // timeout is milliseconds for select_green_thread,
+    // and microseconds for select_green_thread_us
 #ifdef KQUEUE
     void select_green_thread(struct kevent *kev, int num_kev,
                       void * const *stream, int num_stream,
                       bool is_threadq, int64_t timeout);
+    void select_green_thread_us(struct kevent *kev, int num_kev,
+                      void * const *stream, int num_stream,
+                      bool is_threadq, int64_t timeout);
 #elif (defined EPOLL)
     void select_green_thread(epoll_event *eev, int num_eev,
                       void * const *stream, int num_stream,
                       bool is_threadq, int64_t timeout);
+    void select_green_thread_us(epoll_event *eev, int num_eev,
+                      void * const *stream, int num_stream,
+                      bool is_threadq, int64_t timeout);
 #endif // KQUEUE
 
+    // wait join handles in addition to select_green_thread.
+    // handles of stopped green threads are returned by
+    // get_joins_ready_green_thread, and can be passed to join_green_thread
+    // without blocking
+#ifdef KQUEUE
+    void select_join_green_thread(struct kevent *kev, int num_kev,
+                      void * const *stream, int num_stream,
+                      void * const *join, int num_join,
+                      bool is_threadq, int64_t timeout);
+#elif (defined EPOLL)
+    void select_join_green_thread(epoll_event *eev, int num_eev,
+                      void * const *stream, int num_stream,
+                      void * const *join, int num_join,
+                      bool is_threadq, int64_t timeout);
+#endif // KQUEUE
+
+    // on Linux, file descriptors waited by select_green_thread are
+    // registered to epoll with EPOLLET once, so that a green thread woken
+    // for a file descriptor should read or write it until EAGAIN before
+    // waiting it again. such file descriptors must be closed by
+    // close_fd_green_thread, which drops the registration
+    int         close_fd_green_thread(int fd);
+
     void*       get_threadq_green_thread(uint64_t thid);
     STRM_RESULT push_threadq_green_thread(void *thq, char *p);
     STRM_RESULT pop_threadq_green_thread(char *p);
+
+    // batches of the thread queue. p is an array of elements of vecsize.
+    // push_threadq_many_green_thread pushes up to n elements by one
+    // reservation and one notification, and returns the number of pushed
+    // elements, which is 0 if the queue is full, or -1 if closed.
+    // pop_threadq_many_green_thread pops up to max elements, and returns
+    // the number of popped elements, which is 0 if the queue is empty
+    int         push_threadq_many_green_thread(void *thq, char *p, int n);
+    int         pop_threadq_many_green_thread(char *p, int max);
     STRM_RESULT push_stream_ptr(void *p, void *data);
     STRM_RESULT push_stream_bytes(void *p, char *data);
     STRM_RESULT pop_stream_ptr(void *p, void **data);
@@ -201,10 +379,49 @@ extern "C" {
         intptr_t  data;
     };
 
+    // statistics of a scheduler.
+    // counters are read without synchronization, so a snapshot may be
+    // slightly inconsistent
+    struct stats_green_thread {
+        uint64_t num_switches;       // context switches to green threads
+        uint64_t num_spawns;
+        uint64_t num_stops;
+        uint64_t num_timeouts;       // timeouts fired
+        uint64_t num_select_fd;      // calls of kevent or epoll_wait
+        uint64_t select_fd_block_ns; // time blocked in kevent or epoll_wait
+        uint64_t len_run_queue;
+        uint64_t num_contexts;
+        uint64_t num_preemptions;
+        uint64_t num_idle_spins;  // idle waits for the thread queue ended by spinning
+        uint64_t num_idle_yields; // ... by yielding the CPU
+        uint64_t num_idle_parks;  // ... by the condition variable
+        uint64_t num_io_ops;      // operations of the io_uring backend
+        uint64_t num_io_submits;  // io_uring_enter() calls submitting them
+    };
+
+    // CPU accounting of a green thread (see enable_accounting_green_thread)
+    struct context_stats_green_thread {
+        int64_t  id;
+        uint32_t state;
+        uint64_t num_resumes;
+        uint64_t run_cycles; // measured by RDTSC
+    };
+
+    // callable from any thread
+    bool    get_stats_green_thread(uint64_t thid, stats_green_thread *stats);
+    ssize_t get_context_stats_green_thread(uint64_t thid, context_stats_green_thread *stats, size_t len);
+
     void get_streams_ready_green_thread(void ***streams, ssize_t *len);
+    void get_joins_ready_green_thread(void ***handles, ssize_t *len);
     bool is_timeout_green_thread();
     bool is_ready_threadq_green_thread();
     void get_fds_ready_green_thread(fdevent_green_thread **events, ssize_t *len);
+
+    // switch stacks saving only callee-saved registers (X86_64 System V ABI)
+    void lunar_swap_context(uint64_t **save_sp, uint64_t *sp);
+
+    // called by ___INVOKE when func of a green thread returns
+    void finish_green_thread(void *ctx);
 }
 
 class green_thread {
@@ -213,10 +430,46 @@ public:
     virtual ~green_thread();
 
     void schedule();
-    int  spawn(void (*func)(void*), void *arg = nullptr, int stack_size = 4096 * 50);
+    int64_t spawn(void (*func)(void*), void *arg = nullptr, size_t stack_size = 4096 * 50);
+    void*   spawn_joinable(void *(*func)(void*), void *arg, size_t stack_size);
+    bool    join(void *handle, int64_t timeout, void **result);
+    static void detach(void *handle);
+    void    finish(void *ctx);
+
+    // park the running context until unpark(w) is called or timeout
+    // (microseconds, 0 means infinity) expires.
+    // w must be pushed to a wait queue protected by lock in advance, and
+    // lock is released just before switching contexts.
+    // unpark(w) must be called holding the lock after removing w
+    // cancellation resumes the context from park() unless is_cancellable is false
+    void park(gt_waiter *w, int64_t timeout, spin_lock_acquire_unsafe &lock,
+              bool is_cancellable = true);
+    static void unpark(gt_waiter *w);
+
+    bool cancel(int64_t id);
     void run();
     STRM_RESULT push_threadq(char *p) { return m_threadq->push(p); }
     STRM_RESULT pop_threadq(char *p) { return m_threadq->pop(p); }
+    int pop_threadq_many(char *p, int max) { return m_threadq->pop_many(p, max); }
+
+    int close_fd(int fd);
+
+#ifdef LUNAR_URING
+    // the io_uring backend: must be called before run()
+    bool enable_uring();
+    bool is_uring() { return m_uring != nullptr; }
+
+    // fill an entry got by get_sqe() except for user_data, and wait_io()
+    // parks the running context until its completion, and returns the
+    // result of the operation (-errno on failure).
+    // the operation is submitted when the scheduler has resumed all the
+    // other runnable contexts, or blocks, so that operations of a pass
+    // are submitted by one system call. it is not cancellable
+    io_uring_sqe* get_sqe();
+    int32_t       wait_io(io_uring_sqe *sqe);
+#else
+    bool is_uring() { return false; }
+#endif // LUNAR_URING
 
     void* get_threadq()
     {
@@ -224,14 +477,26 @@ public:
         return m_threadq;
     }
 
+    void set_cpu(int cpu, int node)
+    {
+        m_cpu       = cpu;
+        m_numa_node = node;
+    }
+
+    int get_cpu() { return m_cpu; }
+    int get_numa_node() { return m_numa_node; }
+
+    // timeout is microseconds
 #ifdef KQUEUE
     void select_stream(struct kevent *kev, int num_kev,
                        void * const *stream, int num_stream,
-                       bool is_threadq, int64_t timeout);
+                       bool is_threadq, int64_t timeout,
+                       void * const *join = nullptr, int num_join = 0);
 #elif (defined EPOLL)
     void select_stream(epoll_event *kev, int num_eev,
                        void * const *stream, int num_stream,
-                       bool is_threadq, int64_t timeout);
+                       bool is_threadq, int64_t timeout,
+                       void * const *join = nullptr, int num_join = 0);
 #endif // KQUEUE
 
     template<typename T> STRM_RESULT pop_stream(shared_stream *p, T &ret);
@@ -290,10 +555,78 @@ public:
         *len    =   m_running->m_ev_stream.size();
     }
 
+    void get_joins_ready(void ***handles, ssize_t *len) {
+        *handles = &m_running->m_ev_join[0];
+        *len     =   m_running->m_ev_join.size();
+    }
+
     bool is_timeout() { return m_running->m_is_ev_timeout; }
     bool is_ready_threadq() { return m_running->m_is_ev_thq; }
+    bool is_cancelled() { return m_running->m_is_cancelled; }
+
+    void* get_gls(int key) { return m_running->m_gls[key]; }
+    void  set_gls(int key, void *value) { m_running->m_gls[key] = value; }
+
+    // opt-in work stealing: must be called before run()
+    void enable_steal() { m_is_steal = true; }
+
+    // opt-in per-context CPU accounting: must be called before run()
+    void enable_accounting() { m_is_accounting = true; }
+
+    void set_max_events(int max_events) { m_max_events = max_events > 0 ? max_events : 1; }
+
+    void set_idle_policy(uint64_t spin_us, uint64_t yield_us)
+    {
+        m_idle_spin_ns  = spin_us * 1000;
+        m_idle_yield_ns = yield_us * 1000;
+    }
+
+    // opt-in preemption: must be called before run()
+    bool enable_preemption(uint64_t slice_us);
+    void tick_preemption(); // called by the signal handler
+    void preempt_point() {
+        if (m_is_preempt && m_running)
+            yield_preempted();
+    }
+
+    // resident schedulers keep running without contexts until shutdown
+    // is posted (see lunar_runtime_start)
+    void set_resident() { m_is_resident = true; }
+    void post_spawn(void (*func)(void*), void *arg);
+    void post_shutdown();
+
+    void get_stats(stats_green_thread *stats);
+    ssize_t get_context_stats(context_stats_green_thread *stats, size_t len);
+
+#ifdef __linux__
+    void set_stack_cache(size_t bytes) { m_stack_pool.set_max_cached(bytes); }
+    bool reserve_stack(size_t num_stacks, bool is_guard) {
+        return m_stack_pool.reserve(num_stacks, is_guard);
+    }
+#endif // __linux__
 
 private:
+    struct context;
+
+    // shared by a green thread and its joiner, and released by both.
+    // m_waiter is registered and unregistered only by m_waiter_gt
+    struct join_handle {
+        spin_lock     m_lock;
+        volatile int  m_ref;
+        bool          m_is_done;
+        void         *m_result;  // written by the green thread before m_is_done
+        void *(*m_func)(void*);
+        void         *m_arg;
+        green_thread *m_gt;        // the scheduler of the green thread
+        context      *m_waiter;    // a context waiting the handle
+        green_thread *m_waiter_gt; // the scheduler of m_waiter
+
+        join_handle(green_thread *gt, void *(*func)(void*), void *arg)
+            : m_ref(2), m_is_done(false), m_result(nullptr), m_func(func),
+              m_arg(arg), m_gt(gt),
+              m_waiter(nullptr), m_waiter_gt(nullptr) { }
+    };
+
     struct context {
         // states of contexts
         static const int READY           = 0x0001;
@@ -304,9 +637,15 @@ private:
         static const int WAITING_THQ     = 0x0020;
         static const int WAITING_TIMEOUT = 0x0040;
         static const int STOP            = 0x0080;
+        static const int WAITING_JOIN    = 0x0100;
+        static const int WAITING_SYNC    = 0x0200;
+        static const int WAITING_IO      = 0x0400;
+        static const int WAITING         = WAITING_FD | WAITING_STREAM | WAITING_THQ |
+                                           WAITING_TIMEOUT | WAITING_JOIN | WAITING_SYNC |
+                                           WAITING_IO;
 
-        uint32_t   m_state;
-        sigjmp_buf m_jmp_buf;
+        uint32_t  m_state;
+        uint64_t *m_sp; // saved stack pointer
 
         // waiting events
         std::vector<ev_key> m_fd;       // waiting file descriptors to read
@@ -315,44 +654,40 @@ private:
         // invoked events
         std::vector<void*> m_ev_stream; // streams ready to read
         std::vector<fdevent_green_thread> m_events; // file descriptors ready to read
+        std::vector<void*> m_ev_join;   // join handles of stopped green threads
         bool m_is_ev_thq;     // is the thread queue ready to read
         bool m_is_ev_timeout; // is timeout
 
-        int64_t m_id; // m_id must not be less than or equal to 0
-        uint64_t *m_stack;
-        int m_stack_size;
-    };
+        timer_node m_timer;   // m_timer.m_data points this context
+
+        join_handle *m_join;      // notified when this context stops
+        std::vector<join_handle*> m_wait_join; // waiting join handles
+        bool m_is_remote_join;    // some of m_wait_join are on the other schedulers
+
+        bool m_is_cancelled;
+        bool m_is_nocancel;       // parked by park() which is not cancellable
+
+        uint64_t m_num_resumes;
+        uint64_t m_run_cycles;
 
-    struct ctx_time {
-        uint64_t  m_clock;
-        context  *m_ctx;
+        void *m_gls[GT_GLS_KEYS]; // green thread local storage
 
-        ctx_time(uint64_t clock, context *ctx) : m_clock(clock), m_ctx(ctx) { }
+        int64_t m_id; // m_id must not be less than or equal to 0 (see slot_table)
+        uint64_t *m_stack;
+        size_t m_stack_size; // words
     };
 
-    typedef boost::multi_index::multi_index_container<
-        ctx_time,
-        boost::multi_index::indexed_by<
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::tag<>,
-                boost::multi_index::member<ctx_time, uint64_t, &ctx_time::m_clock>>,
-            boost::multi_index::hashed_unique<
-                boost::multi_index::tag<>,
-                boost::multi_index::member<ctx_time, context*, &ctx_time::m_ctx>>
-        >
-    > timeout_t;
-
-    sigjmp_buf m_jmp_buf;
-    int64_t    m_count;
+    uint64_t  *m_sp; // stack pointer of run()
     context*   m_running;
     context*   m_wait_thq;
-    timeout_t  m_timeout;
+    timer_wheel m_timeout; // a tick is a microsecond
     std::deque<context*> m_suspend;
     std::deque<context*> m_stop;
-    std::unordered_map<int64_t, std::unique_ptr<context>,
-                       std::hash<int64_t>,
-                       std::equal_to<int64_t>,
-                       lunar::slab_allocator<std::pair<const int64_t, std::unique_ptr<context>>>> m_id2context;
+    slot_table<context>  m_id2context;
+
+    // stopped contexts are recycled keeping the capacity of their vectors
+    static const size_t MAX_FREE_CONTEXT = 1024;
+    std::vector<context*> m_free_context;
 
 #ifdef __linux__
     nanahan::Map<ev_key,
@@ -388,84 +723,212 @@ private:
         threadq(int qsize, int vecsize);
         virtual ~threadq();
 
+        // lock-free multiple-producers and single-consumer ring.
+        // every slot has a sequence number followed by an element.
+        // a producer reserves a position by CAS of m_qtail, and publishes
+        // the element by the sequence number (position + 1), and the
+        // consumer releases the slot for the next round (position + size).
+        // the queue is ready when the slot at m_qhead is published, so that
+        // pop() succeeds after is_ready() or a notification, even if
+        // another producer has reserved a position but not published it
         inline STRM_RESULT push(char *p) {
-            if (m_qlen == m_max_qlen)
-                return STRM_NO_VACANCY;
-            else if (m_is_closed)
+            if (m_is_closed)
                 return STRM_CLOSED;
 
-            spin_lock_acquire_unsafe lock(m_qlock);
-
-            if (m_qlen == m_max_qlen)
-                return STRM_NO_VACANCY;
-
-            for (int i = 0; i < m_vecsize; i++)
-                m_qtail[i] = p[i];
+            uint64_t pos = __atomic_load_n(&m_qtail, __ATOMIC_RELAXED);
+            char *slot;
 
-            m_qlen++;
-            m_qtail += m_vecsize;
+            for (;;) {
+                slot = m_q + (pos & m_qmask) * m_slot_size;
 
-            if (m_qtail == m_qend) {
-                m_qtail = m_q;
-            }
+                uint64_t seq  = __atomic_load_n((uint64_t*)slot, __ATOMIC_ACQUIRE);
+                int64_t  diff = (int64_t)(seq - pos);
 
-            if (! m_is_qnotified) {
-                m_is_qnotified = true;
-                if (m_qwait_type == QWAIT_COND) {
-                    lock.unlock();
-                    std::unique_lock<std::mutex> mlock(m_qmutex);
-                    m_qcond.notify_one();
+                if (diff == 0) {
+                    if (__atomic_compare_exchange_n(&m_qtail, &pos, pos + 1, true,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        break;
+                } else if (diff < 0) {
+                    return STRM_NO_VACANCY;
                 } else {
-                    lock.unlock();
-                    char c = '\0';
-                    if (write(m_qpipe[1], &c, sizeof(c)) < 0) {
-                        PRINTERR("could not write data to pipe");
-                        exit(-1);
-                    }
+                    pos = __atomic_load_n(&m_qtail, __ATOMIC_RELAXED);
                 }
-
-                return STRM_SUCCESS;
             }
 
-            lock.unlock();
+            memcpy(slot + sizeof(uint64_t), p, m_vecsize);
+            __atomic_store_n((uint64_t*)slot, pos + 1, __ATOMIC_RELEASE);
+
+            notify();
 
             return STRM_SUCCESS;
         }
 
         inline STRM_RESULT pop(char *p) {
-            int n = 0;
-            while (m_qlen == 0) {
-                if (n++ > 1000)
-                    return STRM_NO_MORE_DATA;
+            char *slot = m_q + (m_qhead & m_qmask) * m_slot_size;
+
+            if (__atomic_load_n((uint64_t*)slot, __ATOMIC_ACQUIRE) != m_qhead + 1)
+                return STRM_NO_MORE_DATA;
+
+            memcpy(p, slot + sizeof(uint64_t), m_vecsize);
+            __atomic_store_n((uint64_t*)slot, m_qhead + m_qsize, __ATOMIC_RELEASE);
+
+            // release for push_many(), which reserves slots by m_qhead
+            __atomic_store_n(&m_qhead, m_qhead + 1, __ATOMIC_RELEASE);
+
+            return STRM_SUCCESS;
+        }
+
+        // push up to n elements of p, and return the number of pushed
+        // elements, or -1 if closed.
+        // slots behind m_qhead have been released by the consumer, so that
+        // a producer reserves all vacant positions at once by one CAS of
+        // m_qtail, and notifies the consumer once
+        inline int push_many(char *p, int n) {
+            if (m_is_closed)
+                return -1;
+
+            if (n <= 0)
+                return 0;
+
+            uint64_t pos = __atomic_load_n(&m_qtail, __ATOMIC_RELAXED);
+            uint64_t num;
+
+            for (;;) {
+                int64_t vacancy = (int64_t)(__atomic_load_n(&m_qhead, __ATOMIC_ACQUIRE) +
+                                            m_qsize - pos);
+                if (vacancy <= 0)
+                    return 0;
+
+                num = (uint64_t)n < (uint64_t)vacancy ? n : vacancy;
+
+                if (__atomic_compare_exchange_n(&m_qtail, &pos, pos + num, true,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                    break;
+            }
+
+            for (uint64_t i = 0; i < num; i++) {
+                char *slot = m_q + ((pos + i) & m_qmask) * m_slot_size;
+                memcpy(slot + sizeof(uint64_t), p + i * m_vecsize, m_vecsize);
+                __atomic_store_n((uint64_t*)slot, pos + i + 1, __ATOMIC_RELEASE);
             }
 
-            for (int i = 0; i < m_vecsize; i++)
-                p[i] = m_qhead[i];
+            if (num > 0)
+                notify();
+
+            return (int)num;
+        }
+
+        // pop up to max elements to p, and return the number of popped
+        // elements. m_qhead is updated once for them
+        inline int pop_many(char *p, int max) {
+            uint64_t head = m_qhead;
+            int num = 0;
+
+            for (; num < max; num++) {
+                char *slot = m_q + ((head + num) & m_qmask) * m_slot_size;
+                if (__atomic_load_n((uint64_t*)slot, __ATOMIC_ACQUIRE) != head + num + 1)
+                    break;
 
-            {
-                spin_lock_acquire lock(m_qlock);
-                m_qlen--;
+                memcpy(p + num * m_vecsize, slot + sizeof(uint64_t), m_vecsize);
+                __atomic_store_n((uint64_t*)slot, head + num + m_qsize, __ATOMIC_RELEASE);
             }
 
-            m_qhead += m_vecsize;
+            __atomic_store_n(&m_qhead, head + num, __ATOMIC_RELEASE);
 
-            if (m_qhead == m_qend) {
-                m_qhead = m_q;
+            return num;
+        }
+
+        // the consumer is going to wait a notification of type.
+        // return false if the queue is ready, and then it must not wait.
+        // either the consumer sees the slot published by a producer, or
+        // the producer sees m_is_qnotified cleared by the consumer, because
+        // both store and then load with seq_cst (see notify())
+        bool prepare_wait(qwait_type type) {
+            m_qwait_type = type;
+            __atomic_store_n(&m_is_qnotified, false, __ATOMIC_SEQ_CST);
+
+            if (is_ready()) {
+                // producers need not notify
+                m_qwait_type = QWAIT_NONE;
+                __atomic_store_n(&m_is_qnotified, true, __ATOMIC_RELAXED);
+                return false;
             }
 
-            return STRM_SUCCESS;
+            return true;
         }
 
-        int get_len() { return m_qlen; }
+        // notify the consumer once for a wait.
+        // the fence orders the publication of slots before the load
+        void notify() {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&m_is_qnotified, __ATOMIC_SEQ_CST))
+                return;
+
+            if (__atomic_exchange_n(&m_is_qnotified, true, __ATOMIC_ACQ_REL))
+                return;
+
+            if (m_qwait_type == QWAIT_COND) {
+                std::unique_lock<std::mutex> mlock(m_qmutex);
+                m_qcond.notify_one();
+            } else {
+                notify_fd();
+            }
+        }
+
+        // is the element at m_qhead published. called by the consumer
+        bool is_ready() {
+            char *slot = m_q + (m_qhead & m_qmask) * m_slot_size;
+            return __atomic_load_n((uint64_t*)slot, __ATOMIC_SEQ_CST) == m_qhead + 1;
+        }
+#ifdef EPOLL
+        int get_read_fd() { return m_qevent; }
+#else
         int get_read_fd() { return m_qpipe[0]; }
+#endif // EPOLL
+
+        // wake the scheduler sleeping on m_qcond
+        void wake() {
+            std::unique_lock<std::mutex> mlock(m_qmutex);
+            m_qcond.notify_one();
+        }
         qwait_type get_wait_type() { return m_qwait_type; }
         void set_wait_type(qwait_type t) { m_qwait_type = t; }
 
-        void pop_pipe(ssize_t len) {
+        // notifications for the scheduler waiting by QWAIT_PIPE or in
+        // select_fd() (see green_thread::notify_post()).
+        // on Linux, it is an eventfd, which is registered to epoll only
+        // once, and coalesces notifications into the counter.
+        // otherwise, it is a pipe, which is registered to kqueue with
+        // EV_CLEAR only once
+        void notify_fd() {
+#ifdef EPOLL
+            uint64_t n = 1;
+            if (write(m_qevent, &n, sizeof(n)) < 0) {
+#else
+            char c = '\0';
+            if (write(m_qpipe[1], &c, sizeof(c)) < 0) {
+#endif // EPOLL
+                PRINTERR("could not notify the thread queue");
+                exit(-1);
+            }
+        }
+
+        void drain_fd() {
+#ifdef EPOLL
+            uint64_t n;
+            while (read(m_qevent, &n, sizeof(n)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                else if (errno == EAGAIN)
+                    break;
+
+                PRINTERR("could not read data from eventfd");
+                exit(-1);
+            }
+#else
             char buf[16];
-            ssize_t n;
-            do {
-                n = read(m_qpipe[0], buf, sizeof(buf));
+            for (;;) {
+                ssize_t n = read(m_qpipe[0], buf, sizeof(buf));
                 if (n < 0) {
                     if (errno == EINTR)
                         continue;
@@ -476,26 +939,36 @@ private:
                     exit(-1);
                 }
 
-                assert(n != 0);
-                assert(n <= len);
-
-                len -= n;
-            } while (len > 0);
+                if (n < (ssize_t)sizeof(buf))
+                    break;
+            }
+#endif // EPOLL
         }
 
     private:
-        volatile int  m_qlen;
-        volatile bool m_is_qnotified;
+        // m_qtail is written by producers, m_qhead by the consumer, and
+        // m_is_qnotified by both, which is read by every push, so that
+        // they are on different cache lines
+        char                m_pad0[64];
+        volatile uint64_t   m_qtail; // the next position to push
+        char                m_pad1[64];
+        volatile uint64_t   m_qhead; // the next position to pop
+        char                m_pad2[64];
+        volatile bool       m_is_qnotified;
         volatile qwait_type m_qwait_type;
-        int   m_max_qlen;
-        int   m_vecsize;
-        char *m_q;
-        char *m_qend;
-        char *m_qhead;
-        char *m_qtail;
-        int   m_qpipe[2];
+        char                m_pad3[64];
+
+        uint64_t m_qsize; // a power of 2
+        uint64_t m_qmask;
+        int      m_vecsize;
+        size_t   m_slot_size;
+        char    *m_q;
+#ifdef EPOLL
+        int      m_qevent;
+#else
+        int      m_qpipe[2];
+#endif // EPOLL
         volatile bool m_is_closed;
-        spin_lock  m_qlock;
         std::mutex m_qmutex;
         std::condition_variable m_qcond;
 
@@ -508,20 +981,177 @@ private:
     int m_kq;
 #elif (defined EPOLL)
     int m_epoll;
+
+    // persistent edge-triggered registrations
+    // a file descriptor is registered to epoll with EPOLLET when it is
+    // waited on first, and is unregistered by close_fd(). readiness which
+    // has not been delivered to waiters is cached in m_fd_flags, which is
+    // indexed by file descriptors, and is consumed by the next wait.
+    // waits which are not satisfied by the cache check the registration,
+    // because file descriptors closed by the other schedulers are reused
+    static const uint8_t FD_REGISTERED = 0x01;
+    static const uint8_t FD_READY_IN   = 0x02;
+    static const uint8_t FD_READY_OUT  = 0x04;
+
+    void register_fd(int fd, uint32_t events);
+    void wait_fd(int fd, uint32_t event, uint8_t ready);
+    void wake_fd(int fd, uint32_t event, uint8_t ready);
+
+    std::vector<uint8_t> m_fd_flags;
+
+    void select_epoll(int64_t usec);
 #endif // KQUEUE
     void select_fd(bool is_block);
     void resume_timeout();
     void remove_stopped();
 
-#ifndef __linux__
+    // reused buffer of select_fd()
+    static const int DEFAULT_MAX_EVENTS = 256;
+    int m_max_events;
+#ifdef KQUEUE
+    std::vector<struct kevent> m_kev;
+#elif (defined EPOLL)
+    std::vector<epoll_event> m_eev;
+#endif // KQUEUE
+
+    // contexts waiting completions of the io_uring backend
+    int m_num_wait_io;
+    bool is_waiting_fd() { return ! m_wait_fd.empty() || m_num_wait_io > 0; }
+
+#ifdef LUNAR_URING
+    // the epoll descriptor is polled by the ring with this user_data, and
+    // the others point io_request on the stacks of waiting contexts
+    static const uint64_t URING_EPOLL = 0;
+    static const unsigned URING_ENTRIES = 256;
+
+    struct io_request {
+        context *m_ctx;
+        int32_t  m_res;
+    };
+
+    void select_uring(bool is_block, int64_t usec);
+    void poll_epoll();
+
+    uring   *m_uring;
+    uint64_t m_uring_deadline; // m_stats.num_switches to submit entries
+#endif // LUNAR_URING
+
+    // spin and yield until the thread queue becomes non-empty.
+    // return false if the idle policy expires
+    bool idle_threadq();
+
+    uint64_t m_idle_spin_ns;
+    uint64_t m_idle_yield_ns;
+
+    // placement (see init_green_thread_on_cpu)
+    int m_cpu;
+    int m_numa_node;
+
+    // work stealing
+    // an idle scheduler posts its thread ID to a peer's m_steal_req,
+    // and the peer donates a half of its READY or SUSPENDING contexts to
+    // the idle scheduler's m_stolen in the next schedule().
+    // contexts waiting fds, streams, the thread queue or timeouts are
+    // never donated, because they are registered to the owner's wait queues.
+    // neither are contexts on stacks of reserve_stack(), because the
+    // regions are unmapped when the owner exits
+    static const int STEAL_INTERVAL = 1; // milliseconds
+
+    bool steal();
+    bool adopt_stolen();
+    void donate(context *running);
+    bool is_donatable(context *ctx);
+
+    // joins and gt_waiter
+    // a waiter is woken directly if the waker is on the same scheduler,
+    // and otherwise the handle or the gt_waiter is posted to the waiter's
+    // scheduler, which is woken by notify_post()
+    static void invoke_joinable(void *arg);
+    void wake_join(context *ctx, join_handle *h);
+    void wake_sync(gt_waiter *w);
+    void resume_posted();
+    void notify_post();
+    void unregister_join(context *ctx);
+    bool is_polling() {
+        return m_is_steal;
+    }
+
+    // contexts which may be woken by posts of the other schedulers.
+    // joins of this scheduler may be of contexts stolen after the wait
+    bool is_waiting_post() {
+        return m_num_remote_join > 0 || m_num_wait_sync > 0 ||
+               (m_is_steal && m_num_wait_join > 0);
+    }
+
+    int                       m_num_wait_join;   // contexts waiting joins
+    int                       m_num_remote_join; // contexts waiting joins of the other schedulers
+    int                       m_num_wait_sync;   // contexts parked by park()
+    volatile bool             m_is_posted;
+    spin_lock                 m_post_lock;
+    std::vector<join_handle*> m_posted_join;     // protected by m_post_lock
+    std::vector<gt_waiter*>   m_posted_sync;     // protected by m_post_lock
+
+    // spawn_on() and lunar_runtime_shutdown() post to resident schedulers
+    // and wake them by notify_post(), so that idle resident schedulers
+    // sleep without polling
+    std::vector<std::pair<void (*)(void*), void*>> m_posted_spawn; // protected by m_post_lock
+    bool          m_is_shutdown;                                   // protected by m_post_lock
+    volatile bool m_is_resident;
+
+    bool                  m_is_steal;
+    volatile uint64_t     m_steal_req;    // (thread ID + 1) of an idle scheduler
+    uint64_t              m_steal_victim; // (thread ID + 1) of the requested scheduler
+    uint64_t              m_steal_idx;
+    spin_lock             m_steal_lock;
+    std::vector<context*> m_stolen;       // donated contexts protected by m_steal_lock
+
+#ifdef __linux__
+    stack_pool m_stack_pool;
+#else
     slub_stack m_slub_stack;
 #endif // __linux__
 
     int m_pagesize;
 
+    // statistics
+    // while accounting, m_id2context is modified holding m_stats_lock, so
+    // that get_context_stats() can be called by the other threads
+    int64_t insert_context(context *ctx);
+    void    erase_context(int64_t id);
+    void    resume_stats();
+
+#ifdef LUNAR_TRACE
+    static uint32_t trace_reason(uint32_t state); // WAITING_* to trace_reason
+
+    trace_buffer *m_trace;
+#endif // LUNAR_TRACE
+
+    stats_green_thread m_stats;
+    bool               m_is_accounting;
+    uint64_t           m_resume_tsc;
+    spin_lock          m_stats_lock;
+
+    // preemption
+    // the running context is marked if m_stats.num_switches has not been
+    // changed since the last tick, so that it has run for one to two slices.
+    // the timer is disarmed while the scheduler sleeps without contexts
+    // to run, so that idle schedulers are not woken by the signal
+    void yield_preempted();
+    void arm_preemption(bool is_arm);
+
+    volatile bool m_is_preempt;
+    uint64_t      m_preempt_seq; // m_stats.num_switches at the last tick
+#ifdef __linux__
+    bool          m_is_preempt_timer;
+    timer_t       m_preempt_timer;
+    itimerspec    m_preempt_slice;
+#endif // __linux__
+
     friend void spawn_green_thread(void (*func)(void*), void *arg);
+    friend void run_green_thread();
 
     friend STRM_RESULT push_threadq_green_thread(void *thq, char *p);
+    friend int push_threadq_many_green_thread(void *thq, char *p, int n);
 };
 
 }
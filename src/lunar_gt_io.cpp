@@ -0,0 +1,373 @@
+#include "lunar_gt_io.hpp"
+
+#include <poll.h>
+
+namespace lunar {
+
+extern __thread green_thread *lunar_gt;
+
+// wait until fd is ready to read or write.
+// return false if the green thread is cancelled
+static bool
+wait_ready(int fd, bool is_write)
+{
+#ifdef LUNAR_URING
+    if (lunar_gt->is_uring()) {
+        auto sqe = lunar_gt->get_sqe();
+
+        sqe->opcode      = IORING_OP_POLL_ADD;
+        sqe->fd          = fd;
+        sqe->poll_events = is_write ? POLLOUT : POLLIN;
+
+        lunar_gt->wait_io(sqe);
+
+        return true;
+    }
+#endif // LUNAR_URING
+
+#ifdef KQUEUE
+    struct kevent kev;
+    EV_SET(&kev, fd, is_write ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0, 0);
+    select_green_thread(&kev, 1, nullptr, 0, false, 0);
+#elif (defined EPOLL)
+    epoll_event eev;
+    eev.data.fd = fd;
+    eev.events  = is_write ? EPOLLOUT : EPOLLIN;
+    select_green_thread(&eev, 1, nullptr, 0, false, 0);
+#endif // KQUEUE
+
+    return ! is_cancelled_green_thread();
+}
+
+// try_io() calls the system call, and prep_io() fills an entry of the
+// ring for the same operation. the result is returned as the system call
+template<typename T>
+static T
+do_io(int fd, bool is_write, T (*try_io)(void*), void (*prep_io)(void*, void*), void *arg)
+{
+#ifdef LUNAR_URING
+    if (lunar_gt->is_uring()) {
+        for (;;) {
+            auto sqe = lunar_gt->get_sqe();
+            prep_io(sqe, arg);
+
+            int32_t res = lunar_gt->wait_io(sqe);
+            if (res >= 0)
+                return res;
+
+            // non-blocking file descriptors may not be polled by the kernel
+            if (res == -EAGAIN) {
+                wait_ready(fd, is_write);
+                continue;
+            } else if (res == -EINTR) {
+                continue;
+            }
+
+            errno = -res;
+            return -1;
+        }
+    }
+#endif // LUNAR_URING
+
+    for (;;) {
+        T ret = try_io(arg);
+        if (ret >= 0)
+            return ret;
+
+        if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        if (! wait_ready(fd, is_write)) {
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+}
+
+// arguments of system calls
+struct io_args {
+    int          fd;
+    void        *buf;
+    size_t       count;
+    const iovec *iov;
+    int          iovcnt;
+    msghdr      *msg;
+    int          flags;
+    sockaddr    *addr;
+    socklen_t    addrlen;
+    socklen_t   *paddrlen;
+};
+
+// return the file descriptor of strm, or -1 if strm is not readable or
+// writable (flag is shared_stream::READ or shared_stream::WRITE)
+static int
+stream_fd(shared_stream *strm, uint32_t flag)
+{
+    if (! (strm->flag & flag)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return strm->shared_data->stream.fd;
+}
+
+ssize_t
+gt_read(int fd, void *buf, size_t count)
+{
+    io_args args = {};
+    args.fd    = fd;
+    args.buf   = buf;
+    args.count = count;
+
+    return do_io<ssize_t>(fd, false,
+        [](void *p) -> ssize_t {
+            auto a = (io_args*)p;
+            return read(a->fd, a->buf, a->count);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->buf;
+            sqe->len    = a->count;
+            sqe->off    = (uint64_t)-1; // the current position
+#endif // LUNAR_URING
+        }, &args);
+}
+
+ssize_t
+gt_write(int fd, const void *buf, size_t count)
+{
+    io_args args = {};
+    args.fd    = fd;
+    args.buf   = (void*)buf;
+    args.count = count;
+
+    return do_io<ssize_t>(fd, true,
+        [](void *p) -> ssize_t {
+            auto a = (io_args*)p;
+            return write(a->fd, a->buf, a->count);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->buf;
+            sqe->len    = a->count;
+            sqe->off    = (uint64_t)-1;
+#endif // LUNAR_URING
+        }, &args);
+}
+
+ssize_t
+gt_readv(int fd, const iovec *iov, int iovcnt)
+{
+    io_args args = {};
+    args.fd     = fd;
+    args.iov    = iov;
+    args.iovcnt = iovcnt;
+
+    return do_io<ssize_t>(fd, false,
+        [](void *p) -> ssize_t {
+            auto a = (io_args*)p;
+            return readv(a->fd, a->iov, a->iovcnt);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->iov;
+            sqe->len    = a->iovcnt;
+            sqe->off    = (uint64_t)-1;
+#endif // LUNAR_URING
+        }, &args);
+}
+
+ssize_t
+gt_writev(int fd, const iovec *iov, int iovcnt)
+{
+    io_args args = {};
+    args.fd     = fd;
+    args.iov    = iov;
+    args.iovcnt = iovcnt;
+
+    return do_io<ssize_t>(fd, true,
+        [](void *p) -> ssize_t {
+            auto a = (io_args*)p;
+            return writev(a->fd, a->iov, a->iovcnt);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->iov;
+            sqe->len    = a->iovcnt;
+            sqe->off    = (uint64_t)-1;
+#endif // LUNAR_URING
+        }, &args);
+}
+
+ssize_t
+gt_recvmsg(int fd, msghdr *msg, int flags)
+{
+    io_args args = {};
+    args.fd    = fd;
+    args.msg   = msg;
+    args.flags = flags;
+
+    return do_io<ssize_t>(fd, false,
+        [](void *p) -> ssize_t {
+            auto a = (io_args*)p;
+            return recvmsg(a->fd, a->msg, a->flags);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode    = IORING_OP_RECVMSG;
+            sqe->fd        = a->fd;
+            sqe->addr      = (uint64_t)a->msg;
+            sqe->len       = 1;
+            sqe->msg_flags = a->flags;
+#endif // LUNAR_URING
+        }, &args);
+}
+
+int
+gt_accept(int fd, sockaddr *addr, socklen_t *addrlen)
+{
+    io_args args = {};
+    args.fd       = fd;
+    args.addr     = addr;
+    args.paddrlen = addrlen;
+
+    return do_io<int>(fd, false,
+        [](void *p) -> int {
+            auto a = (io_args*)p;
+            return accept(a->fd, a->addr, a->paddrlen);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->addr;
+            sqe->addr2  = (uint64_t)a->paddrlen;
+#endif // LUNAR_URING
+        }, &args);
+}
+
+int
+gt_connect(int fd, const sockaddr *addr, socklen_t addrlen)
+{
+    io_args args = {};
+    args.fd      = fd;
+    args.addr    = (sockaddr*)addr;
+    args.addrlen = addrlen;
+
+    int ret = do_io<int>(fd, true,
+        [](void *p) -> int {
+            auto a = (io_args*)p;
+            return connect(a->fd, a->addr, a->addrlen);
+        },
+        [](void *s, void *p) {
+#ifdef LUNAR_URING
+            auto sqe = (io_uring_sqe*)s;
+            auto a   = (io_args*)p;
+
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd     = a->fd;
+            sqe->addr   = (uint64_t)a->addr;
+            sqe->off    = a->addrlen;
+#endif // LUNAR_URING
+        }, &args);
+
+    if (ret == 0 || errno != EINPROGRESS)
+        return ret;
+
+    // non-blocking sockets are connected asynchronously
+    if (! wait_ready(fd, true)) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    int err;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return -1;
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t
+gt_read(shared_stream *strm, void *buf, size_t count)
+{
+    int fd = stream_fd(strm, shared_stream::READ);
+    return fd == -1 ? -1 : gt_read(fd, buf, count);
+}
+
+ssize_t
+gt_write(shared_stream *strm, const void *buf, size_t count)
+{
+    int fd = stream_fd(strm, shared_stream::WRITE);
+    return fd == -1 ? -1 : gt_write(fd, buf, count);
+}
+
+ssize_t
+gt_readv(shared_stream *strm, const iovec *iov, int iovcnt)
+{
+    int fd = stream_fd(strm, shared_stream::READ);
+    return fd == -1 ? -1 : gt_readv(fd, iov, iovcnt);
+}
+
+ssize_t
+gt_writev(shared_stream *strm, const iovec *iov, int iovcnt)
+{
+    int fd = stream_fd(strm, shared_stream::WRITE);
+    return fd == -1 ? -1 : gt_writev(fd, iov, iovcnt);
+}
+
+ssize_t
+gt_recvmsg(shared_stream *strm, msghdr *msg, int flags)
+{
+    int fd = stream_fd(strm, shared_stream::READ);
+    return fd == -1 ? -1 : gt_recvmsg(fd, msg, flags);
+}
+
+int
+gt_accept(shared_stream *strm, sockaddr *addr, socklen_t *addrlen)
+{
+    int fd = stream_fd(strm, shared_stream::READ);
+    return fd == -1 ? -1 : gt_accept(fd, addr, addrlen);
+}
+
+int
+gt_connect(shared_stream *strm, const sockaddr *addr, socklen_t addrlen)
+{
+    int fd = stream_fd(strm, shared_stream::READ | shared_stream::WRITE);
+    return fd == -1 ? -1 : gt_connect(fd, addr, addrlen);
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef LUNAR_GT_IO_HPP
+#define LUNAR_GT_IO_HPP
+
+#include "lunar_common.hpp"
+#include "lunar_green_thread.hpp"
+#include "lunar_shared_stream.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace lunar {
+
+// blocking-style I/O for green threads
+//
+// these functions block only the calling green thread, and return as the
+// system calls do, but never fail with EAGAIN. the system call is tried
+// first, and the green thread waits until the file descriptor is ready
+// only on EAGAIN, so that file descriptors with data are never
+// registered to epoll. file descriptors must be non-blocking, and must be
+// closed by close_fd_green_thread. cancelled green threads fail with
+// ECANCELED while waiting.
+// with the io_uring backend (see init_green_thread_ex), an operation is
+// submitted to the ring instead, so that operations of green threads are
+// batched, and the green thread is parked until its completion, which is
+// not cancellable
+ssize_t gt_read(int fd, void *buf, size_t count);
+ssize_t gt_write(int fd, const void *buf, size_t count);
+ssize_t gt_readv(int fd, const iovec *iov, int iovcnt);
+ssize_t gt_writev(int fd, const iovec *iov, int iovcnt);
+ssize_t gt_recvmsg(int fd, msghdr *msg, int flags);
+int     gt_accept(int fd, sockaddr *addr, socklen_t *addrlen);
+int     gt_connect(int fd, const sockaddr *addr, socklen_t addrlen);
+
+// the same functions for streams made by make_fd_stream.
+// they fail with EBADF if the stream is not readable (gt_read, gt_readv,
+// gt_recvmsg and gt_accept) or writable (gt_write and gt_writev)
+ssize_t gt_read(shared_stream *strm, void *buf, size_t count);
+ssize_t gt_write(shared_stream *strm, const void *buf, size_t count);
+ssize_t gt_readv(shared_stream *strm, const iovec *iov, int iovcnt);
+ssize_t gt_writev(shared_stream *strm, const iovec *iov, int iovcnt);
+ssize_t gt_recvmsg(shared_stream *strm, msghdr *msg, int flags);
+int     gt_accept(shared_stream *strm, sockaddr *addr, socklen_t *addrlen);
+int     gt_connect(shared_stream *strm, const sockaddr *addr, socklen_t addrlen);
+
+}
+
+#endif // LUNAR_GT_IO_HPP
@@ -0,0 +1,205 @@
+#include "lunar_gt_sync.hpp"
+
+namespace lunar {
+
+extern __thread green_thread *lunar_gt;
+
+void
+gt_wait_queue::push_back(gt_waiter *w)
+{
+    w->m_prev = m_tail;
+    w->m_next = nullptr;
+    w->m_is_queued = true;
+
+    if (m_tail)
+        m_tail->m_next = w;
+    else
+        m_head = w;
+
+    m_tail = w;
+}
+
+void
+gt_wait_queue::remove(gt_waiter *w)
+{
+    if (w->m_prev)
+        w->m_prev->m_next = w->m_next;
+    else
+        m_head = w->m_next;
+
+    if (w->m_next)
+        w->m_next->m_prev = w->m_prev;
+    else
+        m_tail = w->m_prev;
+
+    w->m_prev = nullptr;
+    w->m_next = nullptr;
+    w->m_is_queued = false;
+}
+
+bool
+gt_wait_queue::wait(spin_lock_acquire_unsafe &lock, int64_t timeout, bool is_cancellable)
+{
+    gt_waiter w;
+
+    push_back(&w);
+    lunar_gt->park(&w, timeout, lock, is_cancellable);
+
+    if (w.m_is_signaled)
+        return true;
+
+    // timeout or cancellation
+    {
+        spin_lock_acquire_unsafe lock2(m_lock);
+        if (w.m_is_queued) {
+            remove(&w);
+            lock2.unlock();
+            return false;
+        }
+        lock2.unlock();
+    }
+
+    // notified just after the timeout, and the notification is posted
+    // from the other scheduler. w must live until it is delivered
+    while (! w.m_is_signaled) {
+        spin_lock_acquire_unsafe lock3(m_lock);
+        lunar_gt->park(&w, 0, lock3, false);
+    }
+
+    return true;
+}
+
+bool
+gt_wait_queue::notify_one()
+{
+    auto w = m_head;
+    if (w == nullptr)
+        return false;
+
+    remove(w);
+    green_thread::unpark(w);
+
+    return true;
+}
+
+void
+gt_wait_queue::notify_all()
+{
+    while (notify_one());
+}
+
+void
+gt_mutex::lock()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    if (! m_is_locked) {
+        m_is_locked = true;
+        lock.unlock();
+        return;
+    }
+
+    // unlock() hands over the ownership
+    m_waiters.wait(lock, 0, false);
+}
+
+bool
+gt_mutex::try_lock()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    if (m_is_locked) {
+        lock.unlock();
+        return false;
+    }
+
+    m_is_locked = true;
+    lock.unlock();
+
+    return true;
+}
+
+void
+gt_mutex::unlock()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    assert(m_is_locked);
+
+    if (! m_waiters.notify_one())
+        m_is_locked = false;
+
+    lock.unlock();
+}
+
+bool
+gt_cond::wait_for(gt_mutex &mutex, int64_t timeout)
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    mutex.unlock();
+    bool result = m_waiters.wait(lock, timeout * 1000);
+    mutex.lock();
+
+    return result;
+}
+
+void
+gt_cond::notify_one()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+    m_waiters.notify_one();
+    lock.unlock();
+}
+
+void
+gt_cond::notify_all()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+    m_waiters.notify_all();
+    lock.unlock();
+}
+
+bool
+gt_semaphore::acquire_for(int64_t timeout)
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    if (m_count > 0) {
+        m_count--;
+        lock.unlock();
+        return true;
+    }
+
+    // release() hands over the count
+    return m_waiters.wait(lock, timeout * 1000);
+}
+
+bool
+gt_semaphore::try_acquire()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    if (m_count == 0) {
+        lock.unlock();
+        return false;
+    }
+
+    m_count--;
+    lock.unlock();
+
+    return true;
+}
+
+void
+gt_semaphore::release()
+{
+    spin_lock_acquire_unsafe lock(m_waiters.m_lock);
+
+    if (! m_waiters.notify_one())
+        m_count++;
+
+    lock.unlock();
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef LUNAR_GT_SYNC_HPP
+#define LUNAR_GT_SYNC_HPP
+
+#include "lunar_common.hpp"
+#include "lunar_spin_lock.hpp"
+#include "lunar_green_thread.hpp"
+
+namespace lunar {
+
+// synchronization primitives for green threads
+//
+// unlike spin_lock and rtm_lock, a green thread waiting these primitives is
+// parked in the scheduler, so that the other green threads on the same OS
+// thread can run. green threads on different OS threads can share them.
+// they must be used by green threads, and timeouts are milliseconds
+// (0 means infinity). waits of gt_cond and gt_semaphore return false
+// for cancelled green threads, but gt_mutex::lock() is not cancellable
+
+// FIFO of gt_waiter protected by m_lock
+class gt_wait_queue {
+public:
+    gt_wait_queue() : m_head(nullptr), m_tail(nullptr) { }
+
+    bool empty() { return m_head == nullptr; }
+
+    // park the running green thread until notified.
+    // lock must hold m_lock, and is released.
+    // return false if timeout (microseconds) expires or the green thread
+    // is cancelled
+    bool wait(spin_lock_acquire_unsafe &lock, int64_t timeout, bool is_cancellable = true);
+
+    // m_lock must be held
+    bool notify_one();
+    void notify_all();
+
+    spin_lock m_lock;
+
+private:
+    void push_back(gt_waiter *w);
+    void remove(gt_waiter *w);
+
+    gt_waiter *m_head;
+    gt_waiter *m_tail;
+};
+
+// the ownership is handed over to a waiter by unlock(), so that waiters
+// acquire the mutex in FIFO order
+class gt_mutex {
+public:
+    gt_mutex() : m_is_locked(false) { }
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+    gt_wait_queue m_waiters;
+    bool          m_is_locked;
+};
+
+class gt_cond {
+public:
+    void wait(gt_mutex &mutex) { wait_for(mutex, 0); }
+    bool wait_for(gt_mutex &mutex, int64_t timeout); // false if timeout
+    void notify_one();
+    void notify_all();
+
+private:
+    gt_wait_queue m_waiters;
+};
+
+class gt_semaphore {
+public:
+    gt_semaphore(int64_t count) : m_count(count) { }
+
+    void acquire() { acquire_for(0); }
+    bool acquire_for(int64_t timeout); // false if timeout
+    bool try_acquire();
+    void release();
+
+private:
+    gt_wait_queue m_waiters;
+    int64_t       m_count;
+};
+
+}
+
+#endif // LUNAR_GT_SYNC_HPP
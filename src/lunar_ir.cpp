@@ -180,21 +180,28 @@ lunar_ir::~lunar_ir()
     scalar_set.clear();
 }
 
+void run_parse(void *ptr);
+
 void
 lunar_ir::compile(const std::string &mainfile)
 {
     int num = std::thread::hardware_concurrency();
-    std::thread **th = new std::thread*[num];
 
-    for (int i = 0; i < num; i++) {
-        th[i] = new std::thread(std::bind(&lunar_ir::run, this, i));
-    }
+    lunar_runtime_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.qlen    = 1;
+    opts.vecsize = 1;
 
-    for (int i = 0; i < num; i++) {
-        th[i]->join();
-        delete th[i];
+    if (! lunar_runtime_start(num, &opts)) {
+        PRINTERR("could not start the runtime!");
+        exit(-1);
     }
-    delete[] th;
+
+    for (int i = 0; i < num; i++)
+        spawn_on(i, run_parse, this);
+
+    // wait until all files are parsed
+    lunar_runtime_shutdown();
 }
 
 #define print_parse_err(str, module, ps)                                \
@@ -2892,12 +2899,4 @@ run_parse(void *ptr)
     }
 }
 
-void
-lunar_ir::run(int idx)
-{
-    init_green_thread(idx, 1, 1);
-    spawn_green_thread(run_parse, this);
-    run_green_thread();
-}
-
 }
\ No newline at end of file
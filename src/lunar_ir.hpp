@@ -49,7 +49,6 @@ public:
     }
 
     void compile(const std::string &mainfile);
-    void run(int idx);
 
     void print()
     {
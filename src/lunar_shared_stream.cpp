@@ -1,4 +1,5 @@
 #include "lunar_shared_stream.hpp"
+#include "lunar_green_thread.hpp"
 #include "lunar_ringq.hpp"
 
 #include <unistd.h>
@@ -143,7 +144,7 @@ deref_fd_stream(shared_stream *ptr)
         ptr->shared_data->refcnt--;
         if (ptr->shared_data->refcnt == 0) {
             lock.unlock();
-            close(ptr->shared_data->stream.fd);
+            close_fd_green_thread(ptr->shared_data->stream.fd);
             return;
         }
 
@@ -159,7 +160,7 @@ deref_fd_stream(shared_stream *ptr)
     } else {
         ptr->shared_data->refcnt--;
         if (ptr->shared_data->refcnt == 0) {
-            close(ptr->shared_data->stream.fd);
+            close_fd_green_thread(ptr->shared_data->stream.fd);
             return;
         }
 
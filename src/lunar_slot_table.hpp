@@ -0,0 +1,108 @@
+#ifndef LUNAR_SLOT_TABLE_HPP
+#define LUNAR_SLOT_TABLE_HPP
+
+/*
+ * CAUTION! THIS CONTAINER IS MT-UNSAFE!
+ */
+
+#include "lunar_common.hpp"
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace lunar {
+
+// table of pointers indexed by generation-tagged IDs
+//
+// pointers are stored in a contiguous array of slots, and free slots are
+// linked by an intrusive free list, so insert(), find() and erase() are
+// O(1). an ID consists of the generation of the slot (upper 32 bits) and
+// the index of the slot (lower 32 bits). the generation is incremented
+// whenever the slot is released, so that stale IDs are never found.
+// IDs are always greater than 0
+template <typename T>
+class slot_table {
+public:
+    slot_table() : m_free(NIL), m_size(0) { }
+
+    size_t size() { return m_size; }
+    bool   empty() { return m_size == 0; }
+
+    int64_t insert(T *ptr)
+    {
+        uint32_t idx;
+
+        if (m_free != NIL) {
+            idx    = m_free;
+            m_free = m_slots[idx].m_next;
+        } else {
+            idx = m_slots.size();
+            m_slots.push_back(slot());
+        }
+
+        m_slots[idx].m_ptr = ptr;
+        m_size++;
+
+        return ((int64_t)m_slots[idx].m_gen << 32) | idx;
+    }
+
+    T* find(int64_t id)
+    {
+        uint32_t idx = (uint64_t)id & 0xffffffff;
+
+        if (idx >= m_slots.size() || m_slots[idx].m_gen != ((uint64_t)id >> 32))
+            return nullptr;
+
+        return m_slots[idx].m_ptr;
+    }
+
+    bool erase(int64_t id)
+    {
+        if (find(id) == nullptr)
+            return false;
+
+        uint32_t idx = (uint64_t)id & 0xffffffff;
+        slot &s = m_slots[idx];
+
+        // the generation is in [1, 2^31) to keep IDs positive
+        if (++s.m_gen == 0x80000000)
+            s.m_gen = 1;
+
+        s.m_ptr  = nullptr;
+        s.m_next = m_free;
+        m_free   = idx;
+        m_size--;
+
+        return true;
+    }
+
+    // call func(ptr) for every pointer in the order of the slots
+    template <typename F>
+    void for_each(F func)
+    {
+        for (auto &s: m_slots) {
+            if (s.m_ptr)
+                func(s.m_ptr);
+        }
+    }
+
+private:
+    static const uint32_t NIL = 0xffffffff;
+
+    struct slot {
+        T       *m_ptr;  // nullptr if the slot is free
+        uint32_t m_gen;
+        uint32_t m_next; // next free slot
+
+        slot() : m_ptr(nullptr), m_gen(1), m_next(NIL) { }
+    };
+
+    std::vector<slot> m_slots;
+    uint32_t m_free; // head of the free list
+    size_t   m_size;
+};
+
+}
+
+#endif // LUNAR_SLOT_TABLE_HPP
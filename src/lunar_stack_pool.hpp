@@ -0,0 +1,241 @@
+#ifndef LUNAR_STACK_POOL_HPP
+#define LUNAR_STACK_POOL_HPP
+
+/*
+ * CAUTION! THIS ALLOCATOR IS MT-UNSAFE!
+ */
+
+#include "lunar_common.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+
+#include <vector>
+#include <unordered_map>
+
+namespace lunar {
+
+// cache of stacks for green threads
+//
+// every stack has a guard page at the lowest address.
+// released stacks are cached in buckets by size and reused without
+// changing the protection. stacks over the high-water mark are unmapped,
+// and the pages of cached stacks are returned to the OS by trim()
+//
+// after reserve() is called, stacks of each size are carved out of one
+// large MAP_NORESERVE region, whose physical pages are committed only
+// when touched. stacks in regions are always cached and never unmapped,
+// and regions are unmapped with the pool, so that stacks in regions must
+// not be passed to the other pools (see is_reserved())
+class stack_pool {
+    struct bucket {
+        std::vector<void*> m_stacks;
+        size_t             m_nclean; // m_stacks[0, m_nclean) have been madvised
+
+        char  *m_region;
+        size_t m_region_next; // index of the next unused slot
+
+        bucket() : m_nclean(0), m_region(nullptr), m_region_next(0) { }
+    };
+
+public:
+    stack_pool(size_t pagesize, size_t max_cached = 64 * 1024 * 1024)
+        : m_pagesize(pagesize),
+          m_cached(0),
+          m_max_cached(max_cached),
+          m_is_dirty(false),
+          m_reserve_num(0),
+          m_is_guard(true) { }
+
+    ~stack_pool()
+    {
+        for (auto &b: m_buckets) {
+            for (auto stack: b.second.m_stacks) {
+                if (! is_in_region(b.second, stack, b.first))
+                    unmap(stack, b.first);
+            }
+
+            if (b.second.m_region)
+                unmap(b.second.m_region, b.first * m_reserve_num);
+        }
+    }
+
+    // reserve regions of num_stacks slots for each stack size.
+    // without guard pages, a region consumes only one memory map
+    // (see /proc/sys/vm/max_map_count for Linux), but stack overflows
+    // are not detected
+    bool reserve(size_t num_stacks, bool is_guard)
+    {
+        if (m_reserve_num != 0 || num_stacks == 0)
+            return false;
+
+        m_reserve_num = num_stacks;
+        m_is_guard    = is_guard;
+
+        return true;
+    }
+
+    // size must be a multiple of the page size
+    void* allocate(size_t size)
+    {
+        auto it = m_buckets.find(size);
+        if (it != m_buckets.end() && ! it->second.m_stacks.empty()) {
+            auto &b = it->second;
+            void *stack = b.m_stacks.back();
+
+            b.m_stacks.pop_back();
+            if (b.m_nclean > b.m_stacks.size())
+                b.m_nclean = b.m_stacks.size();
+
+            if (! is_in_region(b, stack, size))
+                m_cached -= size;
+
+            return stack;
+        }
+
+        if (m_reserve_num > 0) {
+            auto &b = m_buckets[size];
+            if (b.m_region == nullptr) {
+                void *region = mmap(nullptr, size * m_reserve_num, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (region == MAP_FAILED) {
+                    PRINTERR("failed mmap!: %s", strerror(errno));
+                    exit(-1);
+                }
+
+                b.m_region = (char*)region;
+            }
+
+            if (b.m_region_next < m_reserve_num) {
+                void *stack = b.m_region + size * b.m_region_next++;
+
+                if (m_is_guard && mprotect(stack, m_pagesize, PROT_NONE) < 0) {
+                    PRINTERR("failed mprotect!: %s", strerror(errno));
+                    exit(-1);
+                }
+
+                return stack;
+            }
+
+            // the region is exhausted
+        }
+
+        void *stack = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stack == MAP_FAILED) {
+            PRINTERR("failed mmap!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        // see /proc/sys/vm/max_map_count for Linux
+        if (mprotect(stack, m_pagesize, PROT_NONE) < 0) {
+            PRINTERR("failed mprotect!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        return stack;
+    }
+
+    void deallocate(void *stack, size_t size)
+    {
+        auto &b = m_buckets[size];
+
+        if (is_in_region(b, stack, size)) {
+            b.m_stacks.push_back(stack);
+            m_is_dirty = true;
+            return;
+        }
+
+        if (m_cached + size > m_max_cached) {
+            unmap(stack, size);
+            return;
+        }
+
+        b.m_stacks.push_back(stack);
+        m_cached  += size;
+        m_is_dirty = true;
+    }
+
+    // is the stack carved out of a region of this pool
+    bool is_reserved(void *stack, size_t size)
+    {
+        if (m_reserve_num == 0)
+            return false;
+
+        auto it = m_buckets.find(size);
+        return it != m_buckets.end() && is_in_region(it->second, stack, size);
+    }
+
+    // return the pages of stacks cached after the last trim() to the OS
+    void trim()
+    {
+        if (! m_is_dirty)
+            return;
+
+        for (auto &b: m_buckets) {
+            auto &stacks = b.second.m_stacks;
+            for (size_t i = b.second.m_nclean; i < stacks.size(); i++) {
+                if (madvise((char*)stacks[i] + m_pagesize, b.first - m_pagesize,
+                            MADV_DONTNEED) < 0) {
+                    PRINTERR("failed madvise!: %s", strerror(errno));
+                    exit(-1);
+                }
+            }
+
+            b.second.m_nclean = stacks.size();
+        }
+
+        m_is_dirty = false;
+    }
+
+    void set_max_cached(size_t bytes)
+    {
+        m_max_cached = bytes;
+
+        for (auto &b: m_buckets) {
+            auto &stacks = b.second.m_stacks;
+            for (size_t i = stacks.size(); i > 0 && m_cached > m_max_cached; i--) {
+                if (is_in_region(b.second, stacks[i - 1], b.first))
+                    continue;
+
+                unmap(stacks[i - 1], b.first);
+                stacks.erase(stacks.begin() + (i - 1));
+                m_cached -= b.first;
+
+                if (b.second.m_nclean >= i)
+                    b.second.m_nclean--;
+            }
+        }
+    }
+
+private:
+    bool is_in_region(const bucket &b, void *stack, size_t size)
+    {
+        return b.m_region != nullptr && (char*)stack >= b.m_region &&
+               (char*)stack < b.m_region + size * m_reserve_num;
+    }
+
+    void unmap(void *stack, size_t size)
+    {
+        if (munmap(stack, size) < 0) {
+            PRINTERR("failed munmap!: %s", strerror(errno));
+            exit(-1);
+        }
+    }
+
+    size_t m_pagesize;
+    size_t m_cached;     // bytes of cached stacks
+    size_t m_max_cached; // high-water mark
+    bool   m_is_dirty;
+    size_t m_reserve_num; // slots of each region
+    bool   m_is_guard;    // guard pages for stacks in regions
+    std::unordered_map<size_t, bucket> m_buckets;
+};
+
+}
+
+#endif // LUNAR_STACK_POOL_HPP
@@ -0,0 +1,232 @@
+#ifndef LUNAR_TIMER_WHEEL_HPP
+#define LUNAR_TIMER_WHEEL_HPP
+
+/*
+ * CAUTION! THIS CONTAINER IS MT-UNSAFE!
+ */
+
+#include "lunar_common.hpp"
+
+#include <stdint.h>
+
+namespace lunar {
+
+struct timer_node {
+    timer_node *m_prev;
+    timer_node *m_next;
+    uint64_t    m_expire;
+    uint32_t    m_slot; // level * SLOTS + index
+    void       *m_data;
+
+    timer_node() : m_prev(nullptr), m_next(nullptr), m_expire(0), m_slot(0), m_data(nullptr) { }
+
+    bool is_linked() { return m_next != nullptr; }
+};
+
+// hashed and hierarchical timing wheel
+//
+// level 0 has a slot for every tick of the next 64 ticks, and a slot of
+// level n covers 64^n ticks. nodes in a slot of a higher level are moved
+// to lower levels when the wheel reaches the slot (cascading).
+// insert() and erase() are O(1), and advance() skips empty slots by
+// bitmaps, so fine-grained ticks (e.g. microseconds) are cheap
+class timer_wheel {
+public:
+    static const int      BITS   = 6;
+    static const int      SLOTS  = 1 << BITS;
+    static const int      LEVELS = 4;
+    static const uint64_t MASK   = SLOTS - 1;
+
+    timer_wheel(uint64_t now) : m_now(now), m_size(0)
+    {
+        for (int i = 0; i < LEVELS; i++) {
+            m_bitmap[i] = 0;
+            for (int j = 0; j < SLOTS; j++) {
+                m_slots[i][j].m_prev = &m_slots[i][j];
+                m_slots[i][j].m_next = &m_slots[i][j];
+            }
+        }
+    }
+
+    bool   empty() { return m_size == 0; }
+    size_t size() { return m_size; }
+
+    void insert(timer_node *node, uint64_t expire)
+    {
+        if (expire <= m_now)
+            expire = m_now + 1;
+
+        node->m_expire = expire;
+        place(node);
+        m_size++;
+    }
+
+    void erase(timer_node *node)
+    {
+        if (! node->is_linked())
+            return;
+
+        unlink(node);
+        m_size--;
+    }
+
+    // the earliest tick when some nodes may expire.
+    // nodes of level 0 expire at the tick of the slot, and nodes of the
+    // higher levels are cascaded at the beginning of the slot
+    uint64_t next_expiry()
+    {
+        uint64_t ret = ~(uint64_t)0;
+
+        for (int i = 0; i < LEVELS; i++) {
+            if (m_bitmap[i] == 0)
+                continue;
+
+            int      shift = BITS * i;
+            uint64_t cur   = m_now >> shift;
+            uint64_t pos   = cur & MASK;
+            uint64_t upper = (pos == MASK) ? 0 : m_bitmap[i] & (~(uint64_t)0 << (pos + 1));
+            uint64_t slot;
+
+            // slots not after the current position are for the next round
+            if (upper)
+                slot = (cur & ~MASK) + __builtin_ctzll(upper);
+            else
+                slot = (cur & ~MASK) + SLOTS + __builtin_ctzll(m_bitmap[i]);
+
+            if ((slot << shift) < ret)
+                ret = slot << shift;
+        }
+
+        return ret;
+    }
+
+    // call func(node->m_data) for every node expired by now
+    template <typename F>
+    void advance(uint64_t now, F func)
+    {
+        if (m_size == 0) {
+            if (now > m_now)
+                m_now = now;
+            return;
+        }
+
+        while (m_now < now) {
+            uint64_t t = m_now + 1;
+
+            if ((t & MASK) == 0)
+                cascade(t);
+
+            m_now = t;
+
+            timer_node *head = &m_slots[0][t & MASK];
+            while (head->m_next != head) {
+                timer_node *node = head->m_next;
+                erase(node);
+                func(node->m_data);
+            }
+
+            if (m_size == 0) {
+                m_now = now;
+                break;
+            }
+
+            // skip empty slots until some nodes expire or are cascaded
+            uint64_t next = next_expiry() - 1;
+
+            m_now = next < now ? next : now;
+        }
+    }
+
+private:
+    void place(timer_node *node)
+    {
+        uint64_t delta = node->m_expire - m_now;
+        uint64_t expire = node->m_expire;
+        int level;
+
+        if (delta < ((uint64_t)1 << BITS)) {
+            level = 0;
+        } else if (delta < ((uint64_t)1 << (BITS * 2))) {
+            level = 1;
+        } else if (delta < ((uint64_t)1 << (BITS * 3))) {
+            level = 2;
+        } else {
+            level = 3;
+
+            // beyond the wheel, the node is cascaded again later
+            uint64_t max = m_now + ((uint64_t)1 << (BITS * 4)) - 1;
+            if (expire > max)
+                expire = max;
+        }
+
+        int idx = (expire >> (BITS * level)) & MASK;
+        timer_node *head = &m_slots[level][idx];
+
+        node->m_slot = level * SLOTS + idx;
+        node->m_prev = head->m_prev;
+        node->m_next = head;
+        head->m_prev->m_next = node;
+        head->m_prev = node;
+
+        m_bitmap[level] |= (uint64_t)1 << idx;
+    }
+
+    void unlink(timer_node *node)
+    {
+        int level = node->m_slot / SLOTS;
+        int idx   = node->m_slot % SLOTS;
+
+        node->m_prev->m_next = node->m_next;
+        node->m_next->m_prev = node->m_prev;
+        node->m_prev = nullptr;
+        node->m_next = nullptr;
+
+        timer_node *head = &m_slots[level][idx];
+        if (head->m_next == head)
+            m_bitmap[level] &= ~((uint64_t)1 << idx);
+    }
+
+    // move nodes of the higher levels reached at the tick t
+    void cascade(uint64_t t)
+    {
+        m_now = t;
+
+        for (int i = 1; i < LEVELS; i++) {
+            int idx = (t >> (BITS * i)) & MASK;
+            timer_node *head = &m_slots[i][idx];
+
+            // place() may insert nodes to this slot again at the top level
+            timer_node list;
+            list.m_next = head->m_next;
+            list.m_prev = head->m_prev;
+            if (list.m_next == head)
+                list.m_next = list.m_prev = &list;
+            else {
+                list.m_next->m_prev = &list;
+                list.m_prev->m_next = &list;
+            }
+
+            head->m_next = head->m_prev = head;
+            m_bitmap[i] &= ~((uint64_t)1 << idx);
+
+            while (list.m_next != &list) {
+                timer_node *node = list.m_next;
+                list.m_next = node->m_next;
+                node->m_next->m_prev = &list;
+                place(node);
+            }
+
+            if ((t >> (BITS * i)) & MASK)
+                break;
+        }
+    }
+
+    uint64_t   m_now;  // the last tick processed
+    size_t     m_size;
+    uint64_t   m_bitmap[LEVELS];
+    timer_node m_slots[LEVELS][SLOTS];
+};
+
+}
+
+#endif // LUNAR_TIMER_WHEEL_HPP
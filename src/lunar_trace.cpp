@@ -0,0 +1,173 @@
+#include "lunar_trace.hpp"
+#include "lunar_green_thread.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#include <mutex>
+#include <string>
+
+namespace lunar {
+
+#ifdef LUNAR_TRACE
+
+std::mutex lock_trace;
+std::vector<trace_buffer*> trace_buffers; // protected by lock_trace
+
+// a pair of a cycle count and the clock to convert cycles to time
+static uint64_t trace_tsc_base;
+static uint64_t trace_ns_base;
+
+static void
+flush_trace_at_exit()
+{
+    const char *path = getenv("LUNAR_TRACE_FILE");
+    if (path)
+        flush_trace_green_thread(path);
+}
+
+trace_buffer*
+trace_buffer::create(uint64_t thid)
+{
+    // about 1.5 MiB, so allocate it on the heap
+    auto buf = new trace_buffer(thid);
+
+    std::lock_guard<std::mutex> lock(lock_trace);
+
+    if (trace_buffers.empty()) {
+        trace_tsc_base = rdtsc();
+        trace_ns_base  = get_clock_ns();
+        atexit(flush_trace_at_exit);
+    }
+
+    trace_buffers.push_back(buf);
+
+    return buf;
+}
+
+void
+trace_buffer::snapshot(std::vector<trace_event> &events)
+{
+    uint64_t head  = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > SIZE ? head - SIZE : 0;
+
+    std::vector<trace_event> tmp;
+    for (uint64_t i = start; i < head; i++)
+        tmp.push_back(m_events[i & (SIZE - 1)]);
+
+    // the writer may have overwritten the oldest events, and may be
+    // writing the slot of the event at (head2 - SIZE)
+    uint64_t head2 = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+    uint64_t valid = head2 + 1 > SIZE ? head2 + 1 - SIZE : 0;
+
+    for (uint64_t i = start; i < head; i++) {
+        if (i >= valid)
+            events.push_back(tmp[i - start]);
+    }
+}
+
+static std::string
+reason_str(uint32_t reason)
+{
+    static const char *names[] = {"fd", "stream", "threadq", "timeout", "join", "sync", "cancel", "io"};
+    std::string s;
+
+    for (int i = 0; i < 8; i++) {
+        if (reason & (1 << i)) {
+            if (! s.empty())
+                s += '|';
+            s += names[i];
+        }
+    }
+
+    return s;
+}
+
+// write the events in the Chrome trace event format
+// (the timestamps are microseconds)
+bool
+flush_trace_green_thread(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == nullptr) {
+        PRINTERR("could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(lock_trace);
+
+    double ns_per_cycle = 1.0;
+    uint64_t cycles = rdtsc() - trace_tsc_base;
+    if (cycles > 0)
+        ns_per_cycle = (double)(get_clock_ns() - trace_ns_base) / cycles;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+
+    bool is_first = true;
+    for (auto buf: trace_buffers) {
+        std::vector<trace_event> events;
+        buf->snapshot(events);
+
+        unsigned long long tid = buf->get_thid();
+
+        for (auto &ev: events) {
+            double ts = (int64_t)(ev.m_tsc - trace_tsc_base) * ns_per_cycle * 1e-3;
+            long long id = ev.m_id;
+
+            if (! is_first)
+                fprintf(fp, ",\n");
+            is_first = false;
+
+            switch (ev.m_type) {
+            case TRACE_SPAWN:
+                fprintf(fp, "{\"name\":\"spawn\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%llu,"
+                        "\"ts\":%.3lf,\"args\":{\"id\":%lld,\"stolen\":%s}}",
+                        tid, ts, id, ev.m_arg ? "true" : "false");
+                break;
+            case TRACE_RESUME:
+                fprintf(fp, "{\"name\":\"run\",\"ph\":\"B\",\"pid\":1,\"tid\":%llu,"
+                        "\"ts\":%.3lf,\"args\":{\"id\":%lld}}",
+                        tid, ts, id);
+                break;
+            case TRACE_YIELD:
+                fprintf(fp, "{\"ph\":\"E\",\"pid\":1,\"tid\":%llu,\"ts\":%.3lf,"
+                        "\"args\":{\"end\":\"yield\"}}",
+                        tid, ts);
+                break;
+            case TRACE_BLOCK:
+                fprintf(fp, "{\"ph\":\"E\",\"pid\":1,\"tid\":%llu,\"ts\":%.3lf,"
+                        "\"args\":{\"end\":\"block\",\"wait\":\"%s\"}}",
+                        tid, ts, reason_str(ev.m_arg).c_str());
+                break;
+            case TRACE_WAKE:
+                fprintf(fp, "{\"name\":\"wake\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%llu,"
+                        "\"ts\":%.3lf,\"args\":{\"id\":%lld,\"reason\":\"%s\"}}",
+                        tid, ts, id, reason_str(ev.m_arg).c_str());
+                break;
+            case TRACE_STOP:
+                fprintf(fp, "{\"ph\":\"E\",\"pid\":1,\"tid\":%llu,\"ts\":%.3lf,"
+                        "\"args\":{\"end\":\"stop\"}}",
+                        tid, ts);
+                break;
+            }
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    return true;
+}
+
+#else
+
+// no events are recorded without LUNAR_TRACE
+bool
+flush_trace_green_thread(const char*)
+{
+    return false;
+}
+
+#endif // LUNAR_TRACE
+
+}
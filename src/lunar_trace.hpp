@@ -0,0 +1,94 @@
+#ifndef LUNAR_TRACE_HPP
+#define LUNAR_TRACE_HPP
+
+#include "lunar_common.hpp"
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace lunar {
+
+// cycle counter for CPU accounting and tracing
+static inline uint64_t
+rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t)hi << 32 | lo;
+}
+
+// scheduler event tracing
+//
+// if LUNAR_TRACE is defined, every scheduler records its events to a
+// trace_buffer, which is a ring buffer written only by the thread of the
+// scheduler, and read by the other threads without locks. buffers are
+// kept until the process exits, so that events of exited schedulers can
+// be flushed. flush_trace_green_thread() writes the buffers to a file in
+// the Chrome trace event format, which can be opened by chrome://tracing
+// or ui.perfetto.dev. they are also written to $LUNAR_TRACE_FILE at exit
+// if it is set
+
+enum trace_type {
+    TRACE_SPAWN,  // m_arg is 1 if stolen from the other scheduler
+    TRACE_RESUME,
+    TRACE_YIELD,
+    TRACE_BLOCK,  // m_arg is reasons to wait
+    TRACE_WAKE,   // m_arg is the reason to wake
+    TRACE_STOP,
+};
+
+// reasons of TRACE_BLOCK and TRACE_WAKE
+enum trace_reason {
+    TRACE_FD      = 0x01,
+    TRACE_STREAM  = 0x02,
+    TRACE_THQ     = 0x04,
+    TRACE_TIMEOUT = 0x08,
+    TRACE_JOIN    = 0x10,
+    TRACE_SYNC    = 0x20,
+    TRACE_CANCEL  = 0x40,
+    TRACE_IO      = 0x80,
+};
+
+struct trace_event {
+    uint64_t m_tsc;
+    int64_t  m_id; // context ID
+    uint32_t m_type;
+    uint32_t m_arg;
+};
+
+class trace_buffer {
+public:
+    static const uint64_t SIZE = 1 << 16; // must be power of 2
+
+    // allocate and register a buffer for flush_trace_green_thread()
+    static trace_buffer* create(uint64_t thid);
+
+    void record(uint64_t tsc, uint32_t type, int64_t id, uint32_t arg)
+    {
+        trace_event &ev = m_events[m_head & (SIZE - 1)];
+
+        ev.m_tsc  = tsc;
+        ev.m_id   = id;
+        ev.m_type = type;
+        ev.m_arg  = arg;
+
+        __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELEASE);
+    }
+
+    // copy events which are not overwritten while copying
+    void snapshot(std::vector<trace_event> &events);
+
+    uint64_t get_thid() { return m_thid; }
+
+private:
+    trace_buffer(uint64_t thid) : m_thid(thid), m_head(0) { }
+
+    uint64_t    m_thid;
+    uint64_t    m_head; // the number of recorded events
+    trace_event m_events[SIZE];
+};
+
+}
+
+#endif // LUNAR_TRACE_HPP
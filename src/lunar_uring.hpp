@@ -0,0 +1,226 @@
+#ifndef LUNAR_URING_HPP
+#define LUNAR_URING_HPP
+
+/*
+ * CAUTION! THIS RING IS MT-UNSAFE!
+ */
+
+#include "lunar_common.hpp"
+
+#if (defined __linux__) && (defined __has_include)
+#if __has_include(<linux/io_uring.h>)
+    #define LUNAR_URING
+#endif
+#endif // __linux__
+
+#ifdef LUNAR_URING
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace lunar {
+
+// io_uring without liburing
+//
+// a ring is owned by a scheduler. entries got by get_sqe() are queued in
+// the submission queue, and are submitted together by enter(), which also
+// waits for completions. completions are reaped by reap() without
+// system calls. EXT_ARG (Linux 5.11) is required for timeouts of enter()
+class uring {
+public:
+    uring() : m_fd(-1), m_sq_ptr(nullptr), m_cq_ptr(nullptr), m_sqes(nullptr),
+              m_sqe_tail(0), m_sqe_submitted(0) { }
+
+    ~uring()
+    {
+        if (m_sqes)
+            munmap(m_sqes, m_sqes_size);
+
+        if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+            munmap(m_cq_ptr, m_cq_size);
+
+        if (m_sq_ptr)
+            munmap(m_sq_ptr, m_sq_size);
+
+        if (m_fd != -1)
+            close(m_fd);
+    }
+
+    // return false if io_uring is not available
+    bool init(unsigned entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        m_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (m_fd == -1)
+            return false;
+
+        if (! (p.features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        m_sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            if (m_cq_size > m_sq_size)
+                m_sq_size = m_cq_size;
+        }
+
+        m_sq_ptr = map(m_sq_size, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == nullptr)
+            return false;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cq_ptr = m_sq_ptr;
+        } else {
+            m_cq_ptr = map(m_cq_size, IORING_OFF_CQ_RING);
+            if (m_cq_ptr == nullptr)
+                return false;
+        }
+
+        m_sqes = (io_uring_sqe*)map(m_sqes_size, IORING_OFF_SQES);
+        if (m_sqes == nullptr)
+            return false;
+
+        m_sq_head    = (unsigned*)(m_sq_ptr + p.sq_off.head);
+        m_sq_tail    = (unsigned*)(m_sq_ptr + p.sq_off.tail);
+        m_sq_mask    = *(unsigned*)(m_sq_ptr + p.sq_off.ring_mask);
+        m_sq_entries = *(unsigned*)(m_sq_ptr + p.sq_off.ring_entries);
+        m_cq_head    = (unsigned*)(m_cq_ptr + p.cq_off.head);
+        m_cq_tail    = (unsigned*)(m_cq_ptr + p.cq_off.tail);
+        m_cq_mask    = *(unsigned*)(m_cq_ptr + p.cq_off.ring_mask);
+        m_cqes       = (io_uring_cqe*)(m_cq_ptr + p.cq_off.cqes);
+
+        // the index array is the identity map, so that it is never updated
+        unsigned *array = (unsigned*)(m_sq_ptr + p.sq_off.array);
+        for (unsigned i = 0; i < m_sq_entries; i++)
+            array[i] = i;
+
+        m_sqe_tail = m_sqe_submitted = *m_sq_tail;
+
+        return true;
+    }
+
+    // return nullptr if the submission queue is full
+    io_uring_sqe* get_sqe()
+    {
+        unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sqe_tail - head >= m_sq_entries)
+            return nullptr;
+
+        io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqe_tail++;
+
+        return sqe;
+    }
+
+    unsigned num_unsubmitted() { return m_sqe_tail - m_sqe_submitted; }
+
+    bool has_cqe()
+    {
+        return *m_cq_head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    // submit the queued entries, and wait for wait_nr completions at most
+    // usec microseconds (-1 means infinity).
+    // return false if failed except for interruptions and timeouts
+    bool enter(unsigned wait_nr, int64_t usec)
+    {
+        __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+        unsigned flags = 0;
+        io_uring_getevents_arg arg;
+        __kernel_timespec ts;
+
+        if (wait_nr > 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+
+            if (usec >= 0) {
+                ts.tv_sec  = usec / 1000000;
+                ts.tv_nsec = (usec % 1000000) * 1000;
+
+                memset(&arg, 0, sizeof(arg));
+                arg.ts = (uint64_t)&ts;
+
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+        }
+
+        int ret = syscall(__NR_io_uring_enter, m_fd, num_unsubmitted(), wait_nr, flags,
+                          (flags & IORING_ENTER_EXT_ARG) ? (void*)&arg : nullptr,
+                          (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+        if (ret >= 0) {
+            m_sqe_submitted += ret;
+            return true;
+        }
+
+        // the completion queue is full, or entries are submitted
+        // before interruptions and timeouts
+        if (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY) {
+            m_sqe_submitted = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+            return true;
+        }
+
+        return false;
+    }
+
+    // call func(user_data, res) for every completion
+    template<typename F>
+    unsigned reap(F func)
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n    = tail - head;
+
+        for (; head != tail; head++) {
+            io_uring_cqe *cqe = &m_cqes[head & m_cq_mask];
+            func(cqe->user_data, cqe->res);
+        }
+
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        return n;
+    }
+
+private:
+    char* map(size_t size, off_t offset)
+    {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       m_fd, offset);
+        return p == MAP_FAILED ? nullptr : (char*)p;
+    }
+
+    int    m_fd;
+    char  *m_sq_ptr;
+    char  *m_cq_ptr;
+    size_t m_sq_size;
+    size_t m_cq_size;
+    size_t m_sqes_size;
+
+    io_uring_sqe *m_sqes;
+    unsigned     *m_sq_head;
+    unsigned     *m_sq_tail;
+    unsigned      m_sq_mask;
+    unsigned      m_sq_entries;
+    unsigned      m_sqe_tail;      // the next entry of get_sqe()
+    unsigned      m_sqe_submitted; // entries before it have been submitted
+
+    io_uring_cqe *m_cqes;
+    unsigned     *m_cq_head;
+    unsigned     *m_cq_tail;
+    unsigned      m_cq_mask;
+};
+
+}
+
+#endif // LUNAR_URING
+
+#endif // LUNAR_URING_HPP
@@ -0,0 +1,58 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+#define NUM_THREADS 4
+
+volatile int n = 0;
+
+void
+stop(void *arg)
+{
+    __sync_fetch_and_add(&n, 1);
+    while (n != NUM_THREADS + 1) // barrier
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 1);
+}
+
+void
+thread1(uint64_t thid, int cpu)
+{
+    if (! lunar::init_green_thread_on_cpu(thid, 64, sizeof(int), cpu)) {
+        printf("could not pin thread %llu to CPU %d\n", (unsigned long long)thid, cpu);
+        __sync_fetch_and_add(&n, 1);
+        return;
+    }
+
+    lunar::spawn_green_thread(stop);
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ncpu = std::thread::hardware_concurrency();
+    std::thread th[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++)
+        th[i] = std::thread(thread1, i, i % ncpu);
+
+    while (n != NUM_THREADS);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        uint64_t thids[NUM_THREADS];
+        ssize_t num = lunar::get_nearby_threads_green_thread(i, thids, NUM_THREADS);
+
+        printf("thread %d: CPU = %d, node = %d, nearby =", i,
+               lunar::get_cpu_green_thread(i), lunar::get_numa_node_green_thread(i));
+        for (ssize_t j = 0; j < num; j++)
+            printf(" %llu", (unsigned long long)thids[j]);
+        printf("\n");
+    }
+
+    __sync_fetch_and_add(&n, 1);
+
+    for (int i = 0; i < NUM_THREADS; i++)
+        th[i].join();
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "lunar_green_thread.hpp"
+#include "lunar_gt_sync.hpp"
+
+int fds[2];
+lunar::gt_semaphore sem(0);
+
+int64_t id_fd, id_sem, id_timer;
+
+// wait a pipe which never becomes ready
+void
+wait_fd(void *arg)
+{
+#ifdef KQUEUE
+    struct kevent kev;
+    EV_SET(&kev, fds[0], EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+    lunar::select_green_thread(&kev, 1, nullptr, 0, false, 0);
+#elif (defined EPOLL)
+    epoll_event eev;
+    eev.data.fd = fds[0];
+    eev.events  = EPOLLIN;
+    lunar::select_green_thread(&eev, 1, nullptr, 0, false, 0);
+#endif // KQUEUE
+
+    if (lunar::is_cancelled_green_thread())
+        printf("wait_fd: cancelled\n");
+}
+
+void
+wait_sem(void *arg)
+{
+    if (! sem.acquire_for(0) && lunar::is_cancelled_green_thread())
+        printf("wait_sem: cancelled\n");
+}
+
+void
+wait_timer(void *arg)
+{
+    for (;;) {
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 3600 * 1000);
+        if (lunar::is_cancelled_green_thread()) {
+            printf("wait_timer: cancelled\n");
+            return;
+        }
+    }
+}
+
+void
+canceller(void *arg)
+{
+    // let the others wait
+    lunar::schedule_green_thread();
+
+    lunar::cancel_green_thread(id_fd);
+    lunar::cancel_green_thread(id_sem);
+    lunar::cancel_green_thread(id_timer);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    lunar::init_green_thread(0, 1, 1);
+    id_fd    = lunar::spawn_green_thread_ex(wait_fd, nullptr, GT_STACK_64K, 0);
+    id_sem   = lunar::spawn_green_thread_ex(wait_sem, nullptr, GT_STACK_64K, 0);
+    id_timer = lunar::spawn_green_thread_ex(wait_timer, nullptr, GT_STACK_64K, 0);
+    lunar::spawn_green_thread(canceller);
+    lunar::run_green_thread();
+
+    printf("all green threads have been stopped\n");
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include "lunar_green_thread.hpp"
+#include "lunar_gt_io.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#define NUM_CLIENT   16
+#define NUM_MSG      10000
+#define PAYLOAD_SIZE 56
+
+// usage: green_thread_cpp_echo [uring]
+
+struct message {
+    uint64_t seq;
+    char     payload[PAYLOAD_SIZE];
+};
+
+sockaddr_in server_addr;
+lunar::shared_stream listen_strm;
+
+int
+make_socket()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        PRINTERR("failed socket!: %s", strerror(errno));
+        exit(-1);
+    }
+
+    return fd;
+}
+
+void
+set_options(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+// read until iov is filled, and return false on EOF
+bool
+readv_all(lunar::shared_stream *strm, iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = lunar::gt_readv(strm, iov, iovcnt);
+        if (n <= 0)
+            return false;
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+void
+echo(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+
+    lunar::shared_stream rstrm, wstrm;
+    lunar::make_fd_stream(&rstrm, &wstrm, fd, true);
+
+    char buf[1024];
+
+    for (;;) {
+        iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len  = sizeof(buf);
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t n = lunar::gt_recvmsg(&rstrm, &msg, 0);
+        if (n <= 0)
+            break;
+
+        for (ssize_t off = 0; off < n;) {
+            ssize_t m = lunar::gt_write(&wstrm, buf + off, n - off);
+            if (m <= 0)
+                break;
+            off += m;
+        }
+    }
+
+    lunar::deref_fd_stream(&rstrm);
+    lunar::deref_fd_stream(&wstrm);
+}
+
+void
+server(void *arg)
+{
+    for (int i = 0; i < NUM_CLIENT; i++) {
+        int fd = lunar::gt_accept(&listen_strm, nullptr, nullptr);
+        if (fd == -1) {
+            PRINTERR("failed accept!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        set_options(fd);
+        lunar::spawn_green_thread(echo, (void*)(intptr_t)fd);
+    }
+
+    lunar::deref_fd_stream(&listen_strm);
+}
+
+void*
+client(void *arg)
+{
+    int fd = make_socket();
+    set_options(fd);
+
+    lunar::shared_stream rstrm, wstrm;
+    lunar::make_fd_stream(&rstrm, &wstrm, fd, true);
+
+    if (lunar::gt_connect(&wstrm, (sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        PRINTERR("failed connect!: %s", strerror(errno));
+        exit(-1);
+    }
+
+    message req, rep;
+    memset(&req, 'a', sizeof(req));
+
+    for (uint64_t i = 0; i < NUM_MSG; i++) {
+        req.seq = i;
+
+        // send the header and the payload by one system call
+        iovec iov[2];
+        iov[0].iov_base = &req.seq;
+        iov[0].iov_len  = sizeof(req.seq);
+        iov[1].iov_base = req.payload;
+        iov[1].iov_len  = sizeof(req.payload);
+
+        if (lunar::gt_writev(&wstrm, iov, 2) != sizeof(req)) {
+            PRINTERR("failed writev!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        iov[0].iov_base = &rep.seq;
+        iov[0].iov_len  = sizeof(rep.seq);
+        iov[1].iov_base = rep.payload;
+        iov[1].iov_len  = sizeof(rep.payload);
+
+        if (! readv_all(&rstrm, iov, 2) || rep.seq != i) {
+            PRINTERR("unexpected reply");
+            exit(-1);
+        }
+    }
+
+    lunar::deref_fd_stream(&rstrm);
+    lunar::deref_fd_stream(&wstrm);
+
+    return nullptr;
+}
+
+void
+bench(void *arg)
+{
+    printf("backend: %s\n", lunar::is_uring_green_thread() ? "io_uring" : "epoll");
+
+    auto t0 = lunar::get_clock_ns();
+
+    void *handles[NUM_CLIENT];
+    for (int i = 0; i < NUM_CLIENT; i++)
+        handles[i] = lunar::spawn_joinable_green_thread(client, nullptr, 0, 0);
+
+    for (int i = 0; i < NUM_CLIENT; i++)
+        lunar::join_green_thread(handles[i], 0, nullptr);
+
+    auto t1 = lunar::get_clock_ns();
+
+    lunar::stats_green_thread stats;
+    lunar::get_stats_green_thread(0, &stats);
+
+    printf("%d clients, %d bytes: %lf [round trips/s], %llu polls\n",
+           NUM_CLIENT, (int)sizeof(message), NUM_CLIENT * NUM_MSG / ((t1 - t0) * 1e-9),
+           (unsigned long long)stats.num_select_fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool is_uring = argc > 1 && strcmp(argv[1], "uring") == 0;
+
+    int fd = make_socket();
+    set_options(fd);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port        = 0;
+
+    socklen_t len = sizeof(server_addr);
+    if (bind(fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+        listen(fd, NUM_CLIENT) == -1 ||
+        getsockname(fd, (sockaddr*)&server_addr, &len) == -1) {
+        PRINTERR("failed to listen!: %s", strerror(errno));
+        return 1;
+    }
+
+    lunar::make_fd_stream(&listen_strm, nullptr, fd, true);
+
+    lunar::init_green_thread_ex(0, 0, 0, is_uring ? GT_BACKEND_URING : 0);
+    lunar::spawn_green_thread(server);
+    lunar::spawn_green_thread(bench);
+    lunar::run_green_thread();
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+// a file descriptor registered by thread 1 is closed by thread 2, and
+// its number is reused by thread 1, which must still be woken by it
+
+volatile int n = 0;
+volatile bool is_ok = false;
+
+void
+wait_readable(int fd)
+{
+#ifdef KQUEUE
+    struct kevent kev;
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+    lunar::select_green_thread(&kev, 1, nullptr, 0, false, 2000);
+#elif (defined EPOLL)
+    epoll_event eev;
+    eev.data.fd = fd;
+    eev.events  = EPOLLIN;
+    lunar::select_green_thread(&eev, 1, nullptr, 0, false, 2000);
+#endif // KQUEUE
+}
+
+int
+pop_fd()
+{
+    for (;;) {
+        int fd;
+        if (lunar::pop_threadq_green_thread((char*)&fd) == lunar::STRM_SUCCESS)
+            return fd;
+
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, true, 0);
+    }
+}
+
+void
+push_fd(uint64_t thid, int fd)
+{
+    auto thq = lunar::get_threadq_green_thread(thid);
+    while (lunar::push_threadq_green_thread(thq, (char*)&fd) != lunar::STRM_SUCCESS)
+        lunar::schedule_green_thread();
+}
+
+void
+func1(void *arg)
+{
+    char c = 'x';
+    int p[2];
+    if (pipe(p) < 0) {
+        perror("pipe");
+        return;
+    }
+
+    // register p[0] to the scheduler of thread 1
+    write(p[1], &c, 1);
+    wait_readable(p[0]);
+    read(p[0], &c, 1);
+
+    push_fd(2, p[0]);
+    push_fd(2, p[1]);
+    pop_fd(); // closed by thread 2
+
+    int q[2];
+    if (pipe(q) < 0) {
+        perror("pipe");
+        return;
+    }
+
+    printf("old: %d, new: %d\n", p[0], q[0]);
+
+    push_fd(2, q[1]);
+    wait_readable(q[0]);
+
+    is_ok = ! lunar::is_timeout_green_thread();
+
+    lunar::close_fd_green_thread(q[0]);
+}
+
+void
+func2(void *arg)
+{
+    lunar::close_fd_green_thread(pop_fd());
+    lunar::close_fd_green_thread(pop_fd());
+    push_fd(1, 0);
+
+    int fd = pop_fd();
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 10);
+
+    char c = 'y';
+    write(fd, &c, 1);
+    lunar::close_fd_green_thread(fd);
+}
+
+void
+thread(uint64_t thid, void (*func)(void*))
+{
+    lunar::init_green_thread(thid, 4, sizeof(int));
+    lunar::spawn_green_thread(func);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::thread th1(thread, 1, func1);
+    std::thread th2(thread, 2, func2);
+
+    th1.join();
+    th2.join();
+
+    printf("%s\n", is_ok ? "woken by the reused file descriptor" : "timeout!");
+
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#include "lunar_green_thread.hpp"
+
+#define NUM_GREEN_THREADS 100
+
+int key;
+int num_destructed = 0;
+int num_errors = 0;
+
+void
+destructor(void *value)
+{
+    delete (intptr_t*)value;
+    num_destructed++;
+}
+
+// every green thread sees only its own value across context switches
+void
+func(void *arg)
+{
+    if (lunar::gls_get_green_thread(key) != nullptr)
+        num_errors++;
+
+    lunar::gls_set_green_thread(key, new intptr_t((intptr_t)arg));
+
+    for (int i = 0; i < 10; i++) {
+        lunar::schedule_green_thread();
+
+        if (*(intptr_t*)lunar::gls_get_green_thread(key) != (intptr_t)arg)
+            num_errors++;
+    }
+}
+
+void
+check(void *arg)
+{
+    // wait until the others stop
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 100);
+
+    printf("destructed: %d (expected %d), errors: %d\n",
+           num_destructed, NUM_GREEN_THREADS, num_errors);
+}
+
+int
+main(int argc, char *argv[])
+{
+    key = lunar::gls_create_key_green_thread(destructor);
+
+    lunar::init_green_thread(0, 0, 0);
+
+    for (intptr_t i = 0; i < NUM_GREEN_THREADS; i++)
+        lunar::spawn_green_thread(func, (void*)i);
+
+    lunar::spawn_green_thread(check);
+
+    lunar::run_green_thread();
+
+    return (num_destructed == NUM_GREEN_THREADS && num_errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+#define NUM_MSG 10000
+
+volatile bool is_running = false;
+uint64_t spin_us  = 20;
+uint64_t yield_us = 0;
+
+// receive timestamps from the producer, and measure the latency
+void
+consumer(void *arg)
+{
+    int64_t sum = 0;
+
+    for (int i = 0; i < NUM_MSG;) {
+        int64_t t;
+        if (lunar::pop_threadq_green_thread((char*)&t) == lunar::STRM_NO_MORE_DATA) {
+            lunar::select_green_thread(nullptr, 0, nullptr, 0, true, 0);
+            continue;
+        }
+
+        sum += lunar::get_clock_ns() - t;
+        i++;
+    }
+
+    lunar::stats_green_thread stats;
+    lunar::get_stats_green_thread(1, &stats);
+
+    printf("spin = %llu [us], yield = %llu [us]\n",
+           (unsigned long long)spin_us, (unsigned long long)yield_us);
+    printf("average latency: %lf [us]\n", (double)sum / NUM_MSG * 1e-3);
+    printf("idle: %llu spins, %llu yields, %llu parks\n",
+           (unsigned long long)stats.num_idle_spins,
+           (unsigned long long)stats.num_idle_yields,
+           (unsigned long long)stats.num_idle_parks);
+}
+
+void
+thread1()
+{
+    lunar::init_green_thread(1, 1024, sizeof(int64_t));
+    lunar::set_idle_policy_green_thread(spin_us, yield_us);
+    lunar::spawn_green_thread(consumer);
+
+    is_running = true;
+    lunar::run_green_thread();
+}
+
+// usage: green_thread_cpp_idle [spin_us [yield_us]]
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1)
+        spin_us = strtoull(argv[1], nullptr, 10);
+    if (argc > 2)
+        yield_us = strtoull(argv[2], nullptr, 10);
+
+    std::thread th1(thread1);
+
+    while (! is_running);
+    usleep(10 * 1000);
+
+    auto thq = lunar::get_threadq_green_thread(1);
+
+    // send messages at intervals of about 10 [us]
+    for (int i = 0; i < NUM_MSG; i++) {
+        int64_t t0 = lunar::get_clock_ns();
+        while (lunar::get_clock_ns() - t0 < 10000);
+
+        int64_t t = lunar::get_clock_ns();
+        while (lunar::push_threadq_green_thread(thq, (char*)&t) != lunar::STRM_SUCCESS);
+    }
+
+    th1.join();
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+#define NUM_CHILD 100
+
+volatile int n = 0;
+
+void*
+child(void *arg)
+{
+    for (int i = 0; i < 100; i++) {
+        volatile uint64_t x = 0;
+        for (int j = 0; j < 10000; j++)
+            x += j;
+
+        lunar::schedule_green_thread();
+    }
+
+    return (void*)((intptr_t)arg * 2);
+}
+
+void*
+sleeper(void *arg)
+{
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, (intptr_t)arg);
+    return arg;
+}
+
+// fork and join
+void
+func1(void *arg)
+{
+    void *h[NUM_CHILD];
+
+    for (int i = 0; i < NUM_CHILD; i++)
+        h[i] = lunar::spawn_joinable_green_thread(child, (void*)(intptr_t)i, GT_STACK_16K, 0);
+
+    intptr_t sum = 0;
+    for (int i = 0; i < NUM_CHILD; i++) {
+        void *result;
+        lunar::join_green_thread(h[i], 0, &result);
+        sum += (intptr_t)result;
+    }
+
+    printf("thread %llu: sum = %ld (expected %d)\n", (unsigned long long)lunar::get_thread_id(),
+           (long)sum, NUM_CHILD * (NUM_CHILD - 1));
+}
+
+// join with timeout, and select join handles
+void
+func2(void *arg)
+{
+    void *h1 = lunar::spawn_joinable_green_thread(sleeper, (void*)100, GT_STACK_16K, 0);
+    void *h2 = lunar::spawn_joinable_green_thread(sleeper, (void*)300, GT_STACK_16K, 0);
+
+    if (! lunar::join_green_thread(h2, 10, nullptr))
+        printf("timeout!\n");
+
+    void *hs[] = {h1, h2};
+    int num = 2;
+    while (num > 0) {
+        lunar::select_join_green_thread(nullptr, 0, nullptr, 0, hs, num, false, 0);
+
+        void **ready;
+        ssize_t len;
+        lunar::get_joins_ready_green_thread(&ready, &len);
+
+        for (ssize_t i = 0; i < len; i++) {
+            void *result;
+            void *p = ready[i];
+            if (! lunar::join_green_thread(p, 0, &result))
+                continue;
+
+            printf("joined: %ld\n", (long)(intptr_t)result);
+
+            // remove the joined handle
+            if (hs[0] == p)
+                hs[0] = hs[1];
+            num--;
+        }
+    }
+}
+
+void
+thread1()
+{
+    lunar::init_green_thread(1, 1, 1);
+    lunar::enable_steal_green_thread();
+    lunar::spawn_green_thread(func1);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+void
+idle(void *arg)
+{
+    // keep thread 2 alive to steal children of thread 1
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 500);
+}
+
+void
+thread2()
+{
+    lunar::init_green_thread(2, 1, 1);
+    lunar::enable_steal_green_thread();
+    lunar::spawn_green_thread(idle);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    lunar::init_green_thread(0, 1, 1);
+    lunar::spawn_green_thread(func1);
+    lunar::spawn_green_thread(func2);
+    lunar::run_green_thread();
+
+    // children may be joined on the other scheduler
+    std::thread th1(thread1);
+    std::thread th2(thread2);
+
+    th1.join();
+    th2.join();
+
+    return 0;
+}
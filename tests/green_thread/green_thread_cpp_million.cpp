@@ -0,0 +1,72 @@
+#include "lunar_green_thread.hpp"
+
+#include <string.h>
+#include <sys/resource.h>
+
+// usage: green_thread_cpp_million [number of green threads] [guard]
+//
+// guard pages need 2 memory maps for each green thread
+// (see /proc/sys/vm/max_map_count for Linux)
+
+int num = 1000000;
+long rss0;
+
+long
+get_rss()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes
+#else
+    return usage.ru_maxrss;        // kilobytes
+#endif // __APPLE__
+}
+
+void
+idle(void *arg)
+{
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 3600 * 1000);
+}
+
+void
+report(void *arg)
+{
+    long rss1 = get_rss();
+
+    printf("green threads: %d\n", num);
+    printf("max RSS: %ld [KiB]\n", rss1);
+    printf("RSS per green thread: %lf [KiB]\n", (double)(rss1 - rss0) / num);
+    fflush(stdout);
+
+    exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool is_guard = false;
+
+    if (argc > 1)
+        num = atoi(argv[1]);
+
+    if (argc > 2 && strcmp(argv[2], "guard") == 0)
+        is_guard = true;
+
+    lunar::init_green_thread(0, 1, 1);
+
+    if (! lunar::reserve_stack_green_thread(num + 1, is_guard)) {
+        printf("reservation-based stacks are not supported\n");
+        return 1;
+    }
+
+    rss0 = get_rss();
+
+    for (int i = 0; i < num; i++)
+        lunar::spawn_green_thread_ex(idle, nullptr, GT_STACK_16K, 0);
+
+    lunar::spawn_green_thread(report);
+    lunar::run_green_thread();
+
+    return 0;
+}
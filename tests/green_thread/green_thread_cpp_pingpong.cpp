@@ -0,0 +1,86 @@
+#include "lunar_green_thread.hpp"
+
+#include <sys/socket.h>
+#include <fcntl.h>
+
+#define NUM_MSG 100000
+
+int fds[2];
+
+// wait until fd is readable, and read a message
+void
+recv_msg(int fd, char *c)
+{
+    for (;;) {
+        ssize_t n = read(fd, c, 1);
+        if (n == 1)
+            return;
+
+        if (n == -1 && errno != EAGAIN) {
+            PRINTERR("failed read!: %s", strerror(errno));
+            exit(-1);
+        }
+
+#ifdef KQUEUE
+        struct kevent kev;
+        EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0, 0);
+        lunar::select_green_thread(&kev, 1, nullptr, 0, false, 0);
+#elif (defined EPOLL)
+        epoll_event eev;
+        eev.data.fd = fd;
+        eev.events  = EPOLLIN;
+        lunar::select_green_thread(&eev, 1, nullptr, 0, false, 0);
+#endif // KQUEUE
+    }
+}
+
+void
+ping(void *arg)
+{
+    char c = 0;
+
+    auto t0 = lunar::get_clock_ns();
+
+    for (int i = 0; i < NUM_MSG; i++) {
+        write(fds[0], &c, 1);
+        recv_msg(fds[0], &c);
+    }
+
+    auto t1 = lunar::get_clock_ns();
+
+    printf("%lf [round trips/s]\n", NUM_MSG / ((t1 - t0) * 1e-9));
+
+    lunar::close_fd_green_thread(fds[0]);
+}
+
+void
+pong(void *arg)
+{
+    char c;
+
+    for (int i = 0; i < NUM_MSG; i++) {
+        recv_msg(fds[1], &c);
+        write(fds[1], &c, 1);
+    }
+
+    lunar::close_fd_green_thread(fds[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        PRINTERR("failed socketpair!: %s", strerror(errno));
+        return 1;
+    }
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    lunar::init_green_thread(0, 0, 0);
+    lunar::spawn_green_thread(ping);
+    lunar::spawn_green_thread(pong);
+    lunar::run_green_thread();
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "lunar_green_thread.hpp"
+
+volatile bool is_done = false;
+
+// CPU bound loop, which yields only at preemption points
+void
+hog(void *arg)
+{
+    volatile uint64_t x = 0;
+
+    while (! is_done) {
+        for (int i = 0; i < 1000; i++)
+            x += i;
+
+        lunar::preempt_point_green_thread();
+    }
+}
+
+// the latency of timeouts is bounded by the time slice
+void
+ticker(void *arg)
+{
+    int64_t max = 0;
+
+    for (int i = 0; i < 100; i++) {
+        int64_t start = lunar::get_clock_ns();
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 1);
+        int64_t lat = lunar::get_clock_ns() - start;
+
+        if (lat > max)
+            max = lat;
+    }
+
+    is_done = true;
+
+    lunar::stats_green_thread stats;
+    lunar::get_stats_green_thread(0, &stats);
+
+    printf("max latency of 1 [ms] timeout: %lf [ms]\n", max * 1e-6);
+    printf("preemptions: %llu\n", (unsigned long long)stats.num_preemptions);
+}
+
+int
+main(int argc, char *argv[])
+{
+    lunar::init_green_thread(0, 0, 0);
+
+    if (! lunar::enable_preemption_green_thread(2000)) {
+        printf("preemption is not supported\n");
+        return 0;
+    }
+
+    lunar::spawn_green_thread(hog);
+    lunar::spawn_green_thread(hog);
+    lunar::spawn_green_thread(ticker);
+
+    lunar::run_green_thread();
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "lunar_green_thread.hpp"
+
+#define NUM_THREADS 4
+#define NUM_HOPS    1000
+
+volatile uint64_t hops   = 0;
+volatile uint64_t sleeps = 0;
+
+// hop over the schedulers by spawn_on
+void
+hop(void *arg)
+{
+    intptr_t n = (intptr_t)arg;
+
+    __sync_fetch_and_add(&hops, 1);
+
+    if (n > 1)
+        lunar::spawn_on((lunar::get_thread_id() + 1) % NUM_THREADS, hop, (void*)(n - 1));
+}
+
+void
+sleeper(void *arg)
+{
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 100);
+    __sync_fetch_and_add(&sleeps, 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (! lunar::lunar_runtime_start(NUM_THREADS, nullptr)) {
+        printf("could not start the runtime\n");
+        return 1;
+    }
+
+    auto t0 = lunar::get_clock();
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        lunar::spawn_on(i, hop, (void*)NUM_HOPS);
+        lunar::spawn_on(i, sleeper, nullptr);
+    }
+
+    // the schedulers wait for new green threads while idle
+    while (hops < NUM_THREADS * NUM_HOPS)
+        usleep(1000);
+
+    auto t1 = lunar::get_clock();
+
+    // shutdown waits for the sleepers
+    lunar::lunar_runtime_shutdown();
+
+    uint64_t cnt = hops + sleeps;
+    printf("%llu green threads in %llu [ms] (expected %d)\n",
+           (unsigned long long)cnt, (unsigned long long)(t1 - t0),
+           NUM_THREADS * (NUM_HOPS + 1));
+
+    return cnt == NUM_THREADS * (NUM_HOPS + 1) ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+volatile bool is_running = false;
+volatile bool is_done    = false;
+
+void
+work(void *arg)
+{
+    intptr_t n = (intptr_t)arg;
+
+    while (! is_done) {
+        volatile uint64_t x = 0;
+        for (intptr_t i = 0; i < n; i++)
+            x += i;
+
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 1);
+    }
+}
+
+void
+thread1()
+{
+    lunar::init_green_thread(1, 1, 1);
+    lunar::enable_accounting_green_thread();
+
+    lunar::spawn_green_thread_ex(work, (void*)100000, GT_STACK_64K, 0); // hog
+    lunar::spawn_green_thread_ex(work, (void*)1000, GT_STACK_64K, 0);
+
+    is_running = true;
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::thread th1(thread1);
+
+    while (! is_running);
+    usleep(100 * 1000);
+
+    // take a snapshot from the other thread
+    lunar::stats_green_thread stats;
+    lunar::context_stats_green_thread ctxs[8];
+
+    if (! lunar::get_stats_green_thread(1, &stats)) {
+        printf("no scheduler\n");
+        return 1;
+    }
+
+    ssize_t n = lunar::get_context_stats_green_thread(1, ctxs, 8);
+
+    is_done = true;
+    th1.join();
+
+    printf("switches: %llu\n", (unsigned long long)stats.num_switches);
+    printf("spawns: %llu\n", (unsigned long long)stats.num_spawns);
+    printf("stops: %llu\n", (unsigned long long)stats.num_stops);
+    printf("timeouts: %llu\n", (unsigned long long)stats.num_timeouts);
+    printf("select_fd: %llu calls, %lf [ms] blocked\n",
+           (unsigned long long)stats.num_select_fd, stats.select_fd_block_ns * 1e-6);
+    printf("run queue: %llu, contexts: %llu\n",
+           (unsigned long long)stats.len_run_queue, (unsigned long long)stats.num_contexts);
+
+    for (ssize_t i = 0; i < n; i++) {
+        printf("id = %lld: %llu resumes, %llu cycles\n", (long long)ctxs[i].id,
+               (unsigned long long)ctxs[i].num_resumes,
+               (unsigned long long)ctxs[i].run_cycles);
+    }
+
+    return 0;
+}
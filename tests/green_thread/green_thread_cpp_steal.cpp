@@ -0,0 +1,89 @@
+#include "lunar_green_thread.hpp"
+
+#include <thread>
+
+#define NUM_GT  64
+#define NUM_ITR 10000
+
+volatile int n = 0;
+volatile int done = 0;
+volatile uint64_t cnt[3];
+
+void
+worker(void *arg)
+{
+    for (int i = 0; i < NUM_ITR; i++) {
+        volatile uint64_t x = 0;
+        for (int j = 0; j < 1000; j++)
+            x += j;
+
+        __sync_fetch_and_add(&cnt[lunar::get_thread_id()], 1);
+        lunar::schedule_green_thread();
+    }
+
+    if (__sync_add_and_fetch(&done, 1) == NUM_GT) {
+        int num = 0;
+        auto thq = lunar::get_threadq_green_thread(2);
+        lunar::push_threadq_green_thread(thq, (char*)&num);
+    }
+}
+
+void
+func1(void *arg)
+{
+    for (int i = 0; i < NUM_GT; i++)
+        lunar::spawn_green_thread(worker);
+}
+
+void
+func2(void *arg)
+{
+    for (;;) {
+        int num;
+        if (lunar::pop_threadq_green_thread((char*)&num) == lunar::STRM_SUCCESS)
+            break;
+
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, true, 0);
+    }
+}
+
+void
+thread2()
+{
+    lunar::init_green_thread(2, 1, sizeof(int));
+    lunar::enable_steal_green_thread();
+    lunar::spawn_green_thread(func2);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+void
+thread1()
+{
+    lunar::init_green_thread(1, 1, 1);
+    lunar::enable_steal_green_thread();
+    lunar::spawn_green_thread(func1);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::thread th1(thread1);
+    std::thread th2(thread2);
+
+    th1.join();
+    th2.join();
+
+    printf("thread 1: %llu, thread 2: %llu\n", (unsigned long long)cnt[1],
+           (unsigned long long)cnt[2]);
+
+    return 0;
+}
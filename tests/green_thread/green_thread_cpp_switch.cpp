@@ -0,0 +1,201 @@
+#include "lunar_green_thread.hpp"
+
+#include <setjmp.h>
+
+#include <chrono>
+#include <deque>
+
+#define NUM_SWITCH 10000000
+#define STACK_SIZE 4096
+
+std::chrono::steady_clock::time_point t0;
+
+void
+print_result(const char *name)
+{
+    auto t1 = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    printf("%s: %lf [switches/s]\n", name, NUM_SWITCH / sec);
+}
+
+// initial frame for lunar_swap_context
+uint64_t*
+make_context(uint64_t *stack, void (*func)())
+{
+    uint64_t *top = &stack[STACK_SIZE];
+
+    top[-2] = (uint64_t)func; // return address
+    for (int i = 3; i <= 8; i++)
+        top[-i] = 0;          // %rbp, %rbx, %r12 - %r15
+
+    return &top[-8];
+}
+
+// ping-pong between two green threads through the scheduler
+int num = 0;
+
+void
+func(void *arg)
+{
+    if (num++ == 0)
+        t0 = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < NUM_SWITCH / 2; i++)
+        lunar::schedule_green_thread();
+
+    if (--num == 0)
+        print_result("green_thread");
+}
+
+// ping-pong by lunar_swap_context.
+// lunar_swap_context returns to the other call site, so the return is
+// mispredicted every switch unlike switches from the same call site,
+// which are measured by the run queue below
+uint64_t *main_sp;
+uint64_t *co_sp;
+
+void
+co_swap()
+{
+    for (;;)
+        lunar::lunar_swap_context(&co_sp, main_sp);
+}
+
+// ping-pong by sigsetjmp and siglongjmp, which green_thread used before
+sigjmp_buf main_jmp_buf;
+sigjmp_buf co_jmp_buf;
+
+void
+co_jmp()
+{
+    for (;;) {
+        if (sigsetjmp(co_jmp_buf, 0) == 0)
+            siglongjmp(main_jmp_buf, 1);
+    }
+}
+
+// yield through a run queue of two coroutines as schedule() does,
+// by lunar_swap_context and by sigsetjmp and siglongjmp
+struct coroutine {
+    uint64_t  *sp;
+    sigjmp_buf jmp_buf;
+};
+
+std::deque<coroutine*> runq;
+coroutine *running;
+int num_yield;
+
+void
+yield_swap()
+{
+    auto prev = running;
+    runq.push_back(prev);
+    running = runq.front();
+    runq.pop_front();
+
+    lunar::lunar_swap_context(&prev->sp, running->sp);
+}
+
+void
+yield_jmp()
+{
+    auto prev = running;
+    runq.push_back(prev);
+    running = runq.front();
+    runq.pop_front();
+
+    if (sigsetjmp(prev->jmp_buf, 0) == 0)
+        siglongjmp(running->jmp_buf, 1);
+}
+
+void
+co_yield_swap()
+{
+    for (;;) {
+        if (num_yield-- == 0)
+            lunar::lunar_swap_context(&running->sp, main_sp);
+
+        yield_swap();
+    }
+}
+
+void
+co_yield_jmp()
+{
+    // return to main() after saving the first jmp_buf
+    if (sigsetjmp(running->jmp_buf, 0) == 0)
+        lunar::lunar_swap_context(&running->sp, main_sp);
+
+    for (;;) {
+        if (num_yield-- == 0)
+            siglongjmp(main_jmp_buf, 1);
+
+        yield_jmp();
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint64_t *stack = new uint64_t[STACK_SIZE];
+    uint64_t *stack2 = new uint64_t[STACK_SIZE];
+    coroutine co[2];
+
+    // lunar_swap_context
+    co_sp = make_context(stack, co_swap);
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < NUM_SWITCH / 2; i++)
+        lunar::lunar_swap_context(&main_sp, co_sp);
+    print_result("lunar_swap_context");
+
+    // sigsetjmp and siglongjmp
+    co_sp = make_context(stack, co_jmp);
+    if (sigsetjmp(main_jmp_buf, 0) == 0)
+        lunar::lunar_swap_context(&main_sp, co_sp);
+
+    t0 = std::chrono::steady_clock::now();
+    for (volatile int i = 0; i < NUM_SWITCH / 2; i++) {
+        if (sigsetjmp(main_jmp_buf, 0) == 0)
+            siglongjmp(co_jmp_buf, 1);
+    }
+    print_result("sigsetjmp/siglongjmp");
+
+    // run queue and lunar_swap_context
+    co[0].sp = make_context(stack, co_yield_swap);
+    co[1].sp = make_context(stack2, co_yield_swap);
+    runq.push_back(&co[1]);
+    running   = &co[0];
+    num_yield = NUM_SWITCH;
+
+    t0 = std::chrono::steady_clock::now();
+    lunar::lunar_swap_context(&main_sp, co[0].sp);
+    print_result("run queue + lunar_swap_context");
+
+    // run queue and sigsetjmp and siglongjmp
+    runq.clear();
+    for (int i = 0; i < 2; i++) {
+        co[i].sp = make_context(i == 0 ? stack : stack2, co_yield_jmp);
+        running  = &co[i];
+        lunar::lunar_swap_context(&main_sp, co[i].sp);
+    }
+
+    runq.push_back(&co[1]);
+    running   = &co[0];
+    num_yield = NUM_SWITCH;
+
+    t0 = std::chrono::steady_clock::now();
+    if (sigsetjmp(main_jmp_buf, 0) == 0)
+        siglongjmp(co[0].jmp_buf, 1);
+    print_result("run queue + sigsetjmp/siglongjmp");
+
+    delete[] stack;
+    delete[] stack2;
+
+    // green_thread
+    lunar::init_green_thread(0, 1, 1);
+    lunar::spawn_green_thread(func);
+    lunar::spawn_green_thread(func);
+    lunar::run_green_thread();
+
+    return 0;
+}
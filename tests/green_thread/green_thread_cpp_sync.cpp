@@ -0,0 +1,134 @@
+#include "lunar_green_thread.hpp"
+#include "lunar_gt_sync.hpp"
+
+#include <thread>
+
+#define NUM_GT  32
+#define NUM_ITR 1000
+#define NUM_BUF 4
+
+volatile int n = 0;
+
+lunar::gt_mutex mutex;
+uint64_t counter = 0;
+
+// bounded buffer
+lunar::gt_semaphore empty(NUM_BUF);
+lunar::gt_semaphore full(0);
+lunar::gt_mutex     buf_mutex;
+int buf[NUM_BUF];
+int head = 0, tail = 0;
+uint64_t sum = 0;
+
+lunar::gt_mutex cond_mutex;
+lunar::gt_cond  cond;
+bool is_ready = false;
+
+void
+incr(void *arg)
+{
+    for (int i = 0; i < NUM_ITR; i++) {
+        mutex.lock();
+        uint64_t c = counter;
+        lunar::schedule_green_thread(); // yield in the critical section
+        counter = c + 1;
+        mutex.unlock();
+    }
+}
+
+void
+producer(void *arg)
+{
+    for (int i = 1; i <= NUM_ITR; i++) {
+        empty.acquire();
+        buf_mutex.lock();
+        buf[tail] = i;
+        tail = (tail + 1) % NUM_BUF;
+        buf_mutex.unlock();
+        full.release();
+    }
+}
+
+void
+consumer(void *arg)
+{
+    for (int i = 1; i <= NUM_ITR; i++) {
+        full.acquire();
+        buf_mutex.lock();
+        sum += buf[head];
+        head = (head + 1) % NUM_BUF;
+        buf_mutex.unlock();
+        empty.release();
+    }
+
+    printf("sum = %llu (expected %d)\n", (unsigned long long)sum, NUM_ITR * (NUM_ITR + 1) / 2);
+
+    // wake the waiter
+    cond_mutex.lock();
+    is_ready = true;
+    cond.notify_all();
+    cond_mutex.unlock();
+}
+
+void
+waiter(void *arg)
+{
+    cond_mutex.lock();
+    if (! cond.wait_for(cond_mutex, 1))
+        printf("timeout!\n");
+
+    while (! is_ready)
+        cond.wait(cond_mutex);
+    cond_mutex.unlock();
+
+    printf("notified\n");
+}
+
+void
+thread1()
+{
+    lunar::init_green_thread(1, 1, 1);
+    lunar::enable_steal_green_thread();
+
+    for (int i = 0; i < NUM_GT / 2; i++)
+        lunar::spawn_green_thread(incr);
+
+    lunar::spawn_green_thread(producer);
+    lunar::spawn_green_thread(waiter);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+void
+thread2()
+{
+    lunar::init_green_thread(2, 1, 1);
+    lunar::enable_steal_green_thread();
+
+    for (int i = 0; i < NUM_GT / 2; i++)
+        lunar::spawn_green_thread(incr);
+
+    lunar::spawn_green_thread(consumer);
+
+    __sync_fetch_and_add(&n, 1);
+    while(n != 2); // barrier
+
+    lunar::run_green_thread();
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::thread th1(thread1);
+    std::thread th2(thread2);
+
+    th1.join();
+    th2.join();
+
+    printf("counter = %llu (expected %d)\n", (unsigned long long)counter, NUM_GT * NUM_ITR);
+
+    return 0;
+}
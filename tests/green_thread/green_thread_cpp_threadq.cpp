@@ -1,81 +1,128 @@
 #include "lunar_green_thread.hpp"
 
 #include <thread>
+#include <vector>
 
-volatile int n = 0;
-volatile uint64_t cnt = 0;
+// throughput of the thread queue with 1 to 32 producers, which push and
+// pop elements one by one, or by batches of BATCH_SIZE.
+// the consumer checks that a pop after a wake by the queue succeeds
+
+#define NUM_MSG (1 << 22)
+#define MAX_PRODUCER 32
+#define BATCH_SIZE 64
+
+volatile bool is_ready = false;
+bool is_batch = false;
+uint64_t num_failures = 0;
 
 void
-func1(void *arg)
+consumer(void *arg)
 {
-    __sync_fetch_and_add(&n, 1);
-    while(n != 3); // barrier
+    uint64_t n = (uint64_t)arg;
+
+    is_ready = true;
+
+    bool is_woken = false;
+    for (uint64_t i = 0; i < n;) {
+        int num[BATCH_SIZE];
+        int len;
+        if (is_batch) {
+            len = lunar::pop_threadq_many_green_thread((char*)num, BATCH_SIZE);
+        } else {
+            len = lunar::pop_threadq_green_thread((char*)num) == lunar::STRM_SUCCESS ? 1 : 0;
+        }
+
+        if (len == 0) {
+            if (is_woken)
+                num_failures++;
 
-    for (;;) {
-        int num;
-        if (lunar::pop_threadq_green_thread((char*)&num) == lunar::STRM_NO_MORE_DATA) {
             lunar::select_green_thread(nullptr, 0, nullptr, 0, true, 0);
+            is_woken = lunar::is_ready_threadq_green_thread();
             continue;
         }
 
-        cnt++;
+        is_woken = false;
+
+        i += len;
     }
 }
 
 void
-func2(void *arg)
+producer(uint64_t thid, uint64_t n)
 {
-    __sync_fetch_and_add(&n, 1);
-    while(n != 3); // barrier
+    auto thq = lunar::get_threadq_green_thread(thid);
 
-    int num = 0;
-    auto thq = lunar::get_threadq_green_thread(1);
-    for (;;) lunar::push_threadq_green_thread(thq, (char*)&num);
-}
+    int num[BATCH_SIZE] = {0};
+    for (uint64_t i = 0; i < n;) {
+        if (is_batch) {
+            int len = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+            int ret = lunar::push_threadq_many_green_thread(thq, (char*)num, len);
+            if (ret <= 0) {
+                sched_yield();
+                continue;
+            }
 
-void
-thread3()
-{
-    __sync_fetch_and_add(&n, 1);
-    while(n != 3); // barrier
-
-    for (;;) {
-        uint64_t c0 = cnt;
-        auto t0 = lunar::get_clock();
-        sleep(5);
-        uint64_t c1 = cnt;
-        auto t1 = lunar::get_clock();
-        printf("%lf [ops/s]\n", (c1 - c0) / ((t1 - t0) * 1e-3));
-        fflush(stdout);
+            i += ret;
+        } else {
+            if (lunar::push_threadq_green_thread(thq, (char*)num) != lunar::STRM_SUCCESS) {
+                sched_yield();
+                continue;
+            }
+
+            i++;
+        }
     }
 }
 
 void
-thread2()
+bench(uint64_t thid, int num_producer)
 {
-    lunar::init_green_thread(2, 1, 1);
-    lunar::spawn_green_thread(func2);
-    lunar::run_green_thread();
-}
+    uint64_t n = NUM_MSG / num_producer;
 
-void
-thread1()
-{
-    lunar::init_green_thread(1, 1024, sizeof(int));
-    lunar::spawn_green_thread(func1);
-    lunar::run_green_thread();
+    is_ready = false;
+
+    std::thread th([=]() {
+        lunar::init_green_thread(thid, 1024, sizeof(int));
+        lunar::spawn_green_thread(consumer, (void*)(n * num_producer));
+        lunar::run_green_thread();
+    });
+
+    while (! is_ready)
+        sched_yield();
+
+    auto t0 = lunar::get_clock_ns();
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < num_producer; i++)
+        producers.push_back(std::thread(producer, thid, n));
+
+    for (auto &p: producers)
+        p.join();
+
+    th.join();
+
+    auto t1 = lunar::get_clock_ns();
+
+    printf("%-6s %2d producers: %lf [ops/s]\n", is_batch ? "batch" : "single",
+           num_producer, n * num_producer / ((t1 - t0) * 1e-9));
+    fflush(stdout);
 }
 
 int
 main(int argc, char *argv[])
 {
-    std::thread th1(thread1);
-    std::thread th2(thread2);
-    std::thread th3(thread3);
+    uint64_t thid = 1;
+    for (int i = 1; i <= MAX_PRODUCER; i *= 2)
+        bench(thid++, i);
 
-    th1.join();
-    th2.join();
-    th3.join();
+    is_batch = true;
+    for (int i = 1; i <= MAX_PRODUCER; i *= 2)
+        bench(thid++, i);
+
+    if (num_failures > 0) {
+        printf("%llu pops failed after wakes\n", (unsigned long long)num_failures);
+        return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,39 @@
+#include "lunar_green_thread.hpp"
+
+// build the runtime with -DLUNAR_TRACE, and open trace.json by
+// chrome://tracing or ui.perfetto.dev
+
+void
+func(void *arg)
+{
+    for (int i = 0; i < 10; i++) {
+        lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 1);
+        lunar::schedule_green_thread();
+    }
+}
+
+void
+flush(void *arg)
+{
+    lunar::select_green_thread(nullptr, 0, nullptr, 0, false, 100);
+
+    if (lunar::flush_trace_green_thread("trace.json"))
+        printf("wrote trace.json\n");
+    else
+        printf("tracing is disabled\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    lunar::init_green_thread(0, 0, 0);
+
+    for (int i = 0; i < 4; i++)
+        lunar::spawn_green_thread(func);
+
+    lunar::spawn_green_thread(flush);
+
+    lunar::run_green_thread();
+
+    return 0;
+}
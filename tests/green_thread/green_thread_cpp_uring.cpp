@@ -0,0 +1,164 @@
+#include "lunar_green_thread.hpp"
+#include "lunar_gt_io.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#define NUM_CLIENT 16
+#define NUM_MSG    10000
+#define MSG_SIZE   64
+
+// usage: green_thread_cpp_uring [epoll]
+
+sockaddr_in server_addr;
+int listen_fd;
+int num_done = 0;
+
+int
+make_socket()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        PRINTERR("failed socket!: %s", strerror(errno));
+        exit(-1);
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
+
+// read len bytes, and return false on EOF
+bool
+read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = lunar::gt_read(fd, buf, len);
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+void
+echo(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[MSG_SIZE];
+
+    while (read_all(fd, buf, sizeof(buf)))
+        lunar::gt_write(fd, buf, sizeof(buf));
+
+    lunar::close_fd_green_thread(fd);
+}
+
+void
+server(void *arg)
+{
+    for (int i = 0; i < NUM_CLIENT; i++) {
+        int fd = lunar::gt_accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            PRINTERR("failed accept!: %s", strerror(errno));
+            exit(-1);
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        lunar::spawn_green_thread(echo, (void*)(intptr_t)fd);
+    }
+
+    lunar::close_fd_green_thread(listen_fd);
+}
+
+void
+client(void *arg)
+{
+    int fd = make_socket();
+
+    if (lunar::gt_connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        PRINTERR("failed connect!: %s", strerror(errno));
+        exit(-1);
+    }
+
+    char buf[MSG_SIZE];
+    memset(buf, 'a', sizeof(buf));
+
+    for (int i = 0; i < NUM_MSG; i++) {
+        lunar::gt_write(fd, buf, sizeof(buf));
+        if (! read_all(fd, buf, sizeof(buf))) {
+            PRINTERR("unexpected EOF");
+            exit(-1);
+        }
+    }
+
+    lunar::close_fd_green_thread(fd);
+
+    if (++num_done == NUM_CLIENT) {
+        lunar::stats_green_thread stats;
+        lunar::get_stats_green_thread(0, &stats);
+
+        printf("operations: %llu, submissions: %llu\n",
+               (unsigned long long)stats.num_io_ops,
+               (unsigned long long)stats.num_io_submits);
+    }
+}
+
+void
+bench(void *arg)
+{
+    printf("backend: %s\n", lunar::is_uring_green_thread() ? "io_uring" : "epoll");
+
+    auto t0 = lunar::get_clock_ns();
+
+    void *handles[NUM_CLIENT];
+    for (int i = 0; i < NUM_CLIENT; i++)
+        handles[i] = lunar::spawn_joinable_green_thread([](void *arg) -> void* {
+            client(arg);
+            return nullptr;
+        }, nullptr, 0, 0);
+
+    for (int i = 0; i < NUM_CLIENT; i++)
+        lunar::join_green_thread(handles[i], 0, nullptr);
+
+    auto t1 = lunar::get_clock_ns();
+
+    printf("%lf [round trips/s]\n", NUM_CLIENT * NUM_MSG / ((t1 - t0) * 1e-9));
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool is_epoll = argc > 1 && strcmp(argv[1], "epoll") == 0;
+
+    listen_fd = make_socket();
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port        = 0;
+
+    socklen_t len = sizeof(server_addr);
+    if (bind(listen_fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+        listen(listen_fd, NUM_CLIENT) == -1 ||
+        getsockname(listen_fd, (sockaddr*)&server_addr, &len) == -1) {
+        PRINTERR("failed to listen!: %s", strerror(errno));
+        return 1;
+    }
+
+    lunar::init_green_thread_ex(0, 0, 0, is_epoll ? 0 : GT_BACKEND_URING);
+    lunar::spawn_green_thread(server);
+    lunar::spawn_green_thread(bench);
+    lunar::run_green_thread();
+
+    return 0;
+}
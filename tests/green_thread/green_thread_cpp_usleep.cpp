@@ -0,0 +1,41 @@
+#include "lunar_green_thread.hpp"
+
+// sleep by microsecond timeouts and report how late green threads wake up
+
+const int num_loop = 1000;
+
+void
+func(void *arg)
+{
+    int64_t usec = (int64_t)arg;
+    uint64_t late = 0;
+
+    for (int i = 0; i < num_loop; i++) {
+        uint64_t t0 = lunar::get_clock_ns();
+        lunar::select_green_thread_us(nullptr, 0, nullptr, 0, false, usec);
+        uint64_t t1 = lunar::get_clock_ns();
+
+        late += t1 - t0 - usec * 1000;
+    }
+
+    printf("timeout: %lld [us], late: %lf [us]\n", (long long)usec,
+           (double)late / num_loop * 1e-3);
+}
+
+void
+run(void *arg)
+{
+    func((void*)10);
+    func((void*)100);
+    func((void*)1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+    lunar::init_green_thread(0, 1, 1);
+    lunar::spawn_green_thread(run);
+    lunar::run_green_thread();
+
+    return 0;
+}